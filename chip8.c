@@ -1,8 +1,24 @@
+#define _POSIX_C_SOURCE 200809L	//Sockets for the GDB stub, file status for the ROM cache
+
 #include <stdio.h>
 #include <SDL2/SDL.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 typedef enum{
 	QUIT,
@@ -16,18 +32,69 @@ typedef enum{
 	XOCHIP,
 }extension_t;
 
+typedef enum{
+	QUIRK_VF_RESET = 1 << 0,	//8XY1/8XY2/8XY3 clear VF
+	QUIRK_SHIFT = 1 << 1,		//8XY6/8XYE shift VX in place instead of VY into VX
+	QUIRK_LOAD_STORE = 1 << 2,	//FX55/FX65 leave I alone instead of incrementing it
+	QUIRK_CLIP = 1 << 3,		//Sprites clip at the screen edges instead of wrapping
+	QUIRK_JUMP = 1 << 4,		//BNNN is BXNN, jumping to VX + XNN
+}quirk_t;
+
+typedef enum{
+	STOP_BUDGET = 0,			//Ran every instruction it was given
+	STOP_DRAW = 1 << 0,			//A sprite, clear, scroll or resolution switch changed the display
+	STOP_KEY_WAIT = 1 << 1,		//FX0A is waiting for a key
+	STOP_TIMER_WAIT = 1 << 2,	//FX07 read a running delay timer, most likely polling it
+	STOP_HALT = 1 << 3,			//00FD exited the interpreter
+	STOP_BREAK = 1 << 4,		//A remote debugger halted the machine before an instruction, always stops
+}stop_reason_t;
+
+typedef struct rom_profile rom_profile_t;
+
+typedef bool (*fade_row_t)(uint32_t *colors, const uint64_t row0, const uint64_t row1,
+						   const uint32_t palette[4], const int16_t rate);
+
+typedef struct config config_t;
+
+#define AUDIO_RING_SIZE 8192	//Samples, a power of two
+
+typedef struct{
+	//Single producer, single consumer: the emulation thread renders samples in, SDL's audio thread plays them
+	int16_t samples[AUDIO_RING_SIZE];
+	SDL_atomic_t head;		//Samples ever written, only the emulation thread moves it
+	SDL_atomic_t tail;		//Samples ever played, only the audio callback moves it
+	int16_t last;			//Audio thread only: faded to silence while the ring is empty
+}audio_ring_t;
+
+typedef struct{
+	//Sound generation, run on the emulation thread once per 60Hz tick
+	uint32_t sample_rate;
+	int16_t volume;
+	double tone_step;		//Square wave periods per sample
+	double tone_phase;
+	double pattern_phase;	//XO-CHIP pattern bits, 0-128
+	float gain;				//Ramps over 2ms when the sound timer starts or stops, instead of a click
+	double owed_samples;	//Fraction carried between ticks, like cycle_fraction for instructions
+}synth_t;
+
 typedef struct{
 	SDL_Window *window;
 	SDL_Renderer *renderer;
+	SDL_Texture *screen;
+	SDL_Texture *outlines[2];	//Lores and hires pixel grids
+	fade_row_t fade_row;
 	SDL_AudioSpec want,have;
 	SDL_AudioDeviceID dev;
+	audio_ring_t *audio_ring;
 }sdl_t; 	
 
-typedef struct{
+struct config{
 	uint32_t window_height;
 	uint32_t window_width;
 	uint32_t fg_color;
 	uint32_t bg_color;
+	uint32_t fg2_color;		//XO-CHIP plane 2
+	uint32_t blend_color;	//XO-CHIP pixels lit on both planes
 	uint32_t scale_factor; 	
 	bool pixel_outlines;
 	uint32_t inst_per_sec;
@@ -36,7 +103,35 @@ typedef struct{
 	int16_t volume;
 	float color_lerp_rate;
 	extension_t current_extension;
-}config_t;
+	uint32_t quirks;		//Resolved from the extension's defaults and quirks_on/quirks_off
+	uint32_t quirks_on;
+	uint32_t quirks_off;
+	uint32_t rng_seed;
+	uint32_t rewind_seconds;
+	uint32_t rewind_memory;
+	const char *record_file;
+	const char *replay_file;
+	const char *wav_file;
+	const char *trace_file;
+	const char *profile_file;
+	bool headless;
+	uint32_t bench_frames;
+	uint64_t bench_insts;
+	const char *batch_file;
+	uint32_t batch_copies;
+	uint32_t batch_threads;
+	bool batch_scaling;
+	char **rom_names;
+	int rom_count;
+	char **options;			//The command line options, reapplied over every ROM's profile
+	int option_count;
+	const rom_profile_t *profiles;
+	uint32_t profile_count;
+	bool print_rom_hash;
+	bool decode_trace;
+	bool debug;
+	uint16_t gdb_port;		//0 for no GDB stub
+};
 
 typedef struct{
 	uint16_t opcode;
@@ -47,11 +142,112 @@ typedef struct{
 	uint8_t Y;
 }instruction_t;
 
+typedef struct chip8 chip8_t;
+
+#define TRACE_SIZE 65536	//Entries, a power of two
+#define TRACE_MAGIC 0x52543843u	// "C8TR" read as little endian
+#define TRACE_VERSION 1
+
+typedef struct{
+	//8 bytes so recording one is a single store. Its cycle, the number of instructions traced
+	//before it, follows from its place in the ring and is only written out in the dump
+	uint16_t PC;
+	uint16_t opcode;
+	uint16_t I;			//I and VX after the instruction ran
+	uint8_t X;
+	uint8_t VX;
+}trace_entry_t;
+
+typedef struct{
+	trace_entry_t entries[TRACE_SIZE];
+	uint32_t count;		//Instructions traced so far
+}trace_t;
+
+#define PROFILE_MAX_NODES 4096	//Distinct call stacks, a power of two
+
+typedef struct{
+	uint64_t count;		//Instructions run with exactly this call stack
+	uint32_t parent;
+	uint16_t address;	//The subroutine, 2NNN's NNN
+}profile_node_t;
+
+typedef struct{
+	uint64_t opcodes[0x10000];	//Executions per opcode, grouped into classes for the report
+	uint64_t pcs[0x10000];		//Executions per address
+	uint64_t draws;
+	uint64_t draw_pixels;		//Sprite pixels DXYN went over, in every plane it drew to
+	uint64_t draw_lit;			//Of those, the ones set in the sprite
+	uint64_t frames;
+	uint64_t frame_insts;		//Instructions actually run, so skipped waits don't count
+	uint32_t frame_min;
+	uint32_t frame_max;
+	//Call stacks as a tree followed by 2NNN and 00EE, node 0 being the top level. Lookups of a
+	//node's child go through an open addressed hash of (parent, address)
+	profile_node_t nodes[PROFILE_MAX_NODES];
+	uint32_t node_count;
+	uint32_t node_hash[PROFILE_MAX_NODES * 2];
+	uint32_t current;
+}profile_t;
+
+typedef enum{
+	DEBUG_RUN,
+	DEBUG_STEP,		//Break after steps more instructions
+	DEBUG_OVER,		//Break once the stack is back to depth, so calls run through
+	DEBUG_OUT,		//Break once the stack is below depth
+}debug_mode_t;
+
 typedef struct{
+	uint8_t reg;		//V0-VF, then I, the delay timer and the sound timer
+	uint8_t op;			//Index into the comparisons of check_condition()
+	uint16_t value;
+	bool held;			//True before the last instruction, it breaks when it turns true
+}debug_condition_t;
+
+typedef struct{
+	//Only attached to chip8_t while something is set, so a machine with no breakpoints pays nothing
+	uint8_t breakpoints[0x10000/8];		//One bit per address
+	uint8_t watchpoints[0x10000/8];
+	uint32_t breakpoint_count;
+	uint32_t watchpoint_count;
+	debug_condition_t conditions[16];
+	uint8_t condition_count;
+	debug_mode_t mode;
+	uint32_t steps;
+	uint8_t depth;
+	uint16_t last_PC;		//The instruction being run, for reporting watchpoint hits
+	bool remote;			//Hits halt the machine for the GDB stub instead of opening the prompt
+	bool halted;
+	bool resuming;			//The next instruction is the one a remote halt stopped before, it runs unchecked
+	bool stopped_by_watch;
+	bool watch_hit;
+	uint16_t watch_address;
+	uint8_t watch_old;
+	uint8_t watch_new;
+	uint16_t watch_PC;
+	SDL_atomic_t *commands;	//The GUI's pending commands, the prompt gives up waiting for input on a quit
+}debugger_t;
+
+typedef void (*inst_handler_t)(chip8_t *chip8, const instruction_t *inst, const config_t *config);
+
+typedef struct{
+	inst_handler_t handler;
+	instruction_t inst;
+}decoded_t;
+
+struct chip8{
 	emulator_state_t state;
-	uint8_t ram[4096];
-	bool display[64*32];
-	uint32_t pixel_color[64*32];
+	uint8_t *ram;				//ram_4k, or 64KB on the heap for XO-CHIP
+	uint32_t ram_size;
+	uint8_t ram_4k[4096];
+	decoded_t decoded[4096/2];	//Caches cover the first 4KB, the most that jumps can reach
+	uint8_t block_len[4096/2];
+	bool code_slot[4096/2];
+	uint64_t display[2][64][2];	//Planes of 128x64, two words per row with x = 0 in the MSB of the first. Lores uses 64x32
+	bool hires;
+	uint8_t planes;				//Bitmask of the planes drawn to, always 1 outside XO-CHIP
+	uint8_t audio_pattern[16];
+	uint8_t pitch;
+	bool pattern_loaded;
 	uint16_t stack[12];
 	uint16_t *stack_ptr;
 	uint8_t V[16];
@@ -60,41 +256,331 @@ typedef struct{
 	uint8_t delay_timer;
 	uint8_t sound_timer;
 	bool keypad[16];
+	bool any_key_pressed;
+	uint8_t key;
+	uint32_t rng_state;
+	uint8_t rpl[16];	//SCHIP RPL user flags, FX75/FX85
+	uint32_t cycle_fraction;	//inst_per_sec*frames % 60, so every second runs exactly inst_per_sec instructions
+	uint64_t dirty_rows;
+	uint8_t events;		//stop_reason_t bits raised since emulate_cycles() started
+	bool waiting_for_key;	//The last tick ended parked on FX0A
+	uint32_t tick_left;		//Instructions of a tick a remote debugger cut short, run before the next tick starts
+	uint64_t skipped;		//Instructions of waits skipped instead of run: emulated time, but no work
 	const char *rom_name;
-	instruction_t inst;
-	bool draw;
-}chip8_t;
+	trace_t *trace;		//Execution trace ring, NULL while tracing is off
+	profile_t *profile;	//NULL while profiling is off
+	debugger_t *debugger;	//NULL while nothing is set, and then the core runs without checks
+};
+
+bool fade_row_scalar(uint32_t *colors, const uint64_t row0, const uint64_t row1,
+					 const uint32_t palette[4], const int16_t rate){
+	//Move each channel of the 64 pixels in a row towards its palette color, indexed by the pixel's
+	//plane bits, by rate/256, rounded to nearest so the colors settle exactly on the target.
+	//Returns true once the whole row has
+	bool converged = true;
+
+	for(uint8_t x = 0; x < 64; x++){
+		const uint32_t end_color = palette[((row0 >> (63 - x)) & 1) | (((row1 >> (63 - x)) & 1) << 1)];
+		uint32_t color = 0;
+
+		for(uint8_t shift = 0; shift < 32; shift += 8){
+			const int32_t s = (colors[x] >> shift) & 0xFF;
+			const int32_t e = (end_color >> shift) & 0xFF;
+			//Biased so the shift floors negative deltas the same way the SIMD arithmetic shift does
+			int32_t step = (((e - s) * rate + 128 + (255 << 8)) >> 8) - 255;
+
+			//At low rates the last step rounds to 0, snap to the target instead of stalling
+			if(step == 0) step = e - s;
+
+			color |= (uint32_t)(s + step) << shift;
+		}
 
-uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, const float t){
-	uint8_t s_r = (start_color >> 24) & 0xFF;
-	uint8_t s_g = (start_color >> 16) & 0xFF;
-	uint8_t s_b = (start_color >> 8) & 0xFF;
-	uint8_t s_a = (start_color >> 0) & 0xFF;
+		colors[x] = color;
+		converged &= color == end_color;
+	}
+
+	return converged;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+bool fade_row_sse2(uint32_t *colors, const uint64_t row0, const uint64_t row1,
+				   const uint32_t palette[4], const int16_t rate){
+	//Same math as fade_row_scalar, 4 pixels (16 channels) at a time in 16-bit lanes.
+	//delta*rate needs 17 bits, so it's split as (delta*(rate/2) + (delta*(rate&1) + 128)/2) / 128
+	const __m128i color0 = _mm_set1_epi32(palette[0]);
+	const __m128i color1 = _mm_set1_epi32(palette[1]);
+	const __m128i color2 = _mm_set1_epi32(palette[2]);
+	const __m128i color3 = _mm_set1_epi32(palette[3]);
+	const __m128i lane_bits = _mm_set_epi32(1, 2, 4, 8);
+	const __m128i t_half = _mm_set1_epi16(rate >> 1);
+	const __m128i t_odd = _mm_set1_epi16(rate & 1);
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128i zero = _mm_setzero_si128();
+	int converged = 0xFFFF;
+
+	for(uint8_t x = 0; x < 64; x += 4){
+		const __m128i bits0 = _mm_and_si128(_mm_set1_epi32((row0 >> (60 - x)) & 0xF), lane_bits);
+		const __m128i bits1 = _mm_and_si128(_mm_set1_epi32((row1 >> (60 - x)) & 0xF), lane_bits);
+		const __m128i lit0 = _mm_cmpeq_epi32(bits0, lane_bits);
+		const __m128i lit1 = _mm_cmpeq_epi32(bits1, lane_bits);
+		const __m128i without_plane1 = _mm_or_si128(_mm_and_si128(lit0, color1), _mm_andnot_si128(lit0, color0));
+		const __m128i with_plane1 = _mm_or_si128(_mm_and_si128(lit0, color3), _mm_andnot_si128(lit0, color2));
+		const __m128i end = _mm_or_si128(_mm_and_si128(lit1, with_plane1), _mm_andnot_si128(lit1, without_plane1));
+		const __m128i start = _mm_loadu_si128((const __m128i *)&colors[x]);
+
+		__m128i s_lo = _mm_unpacklo_epi8(start, zero);
+		__m128i s_hi = _mm_unpackhi_epi8(start, zero);
+		const __m128i d_lo = _mm_sub_epi16(_mm_unpacklo_epi8(end, zero), s_lo);
+		const __m128i d_hi = _mm_sub_epi16(_mm_unpackhi_epi8(end, zero), s_hi);
+
+		__m128i step_lo = _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(d_lo, t_half),
+							_mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(d_lo, t_odd), round), 1)), 7);
+		__m128i step_hi = _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(d_hi, t_half),
+							_mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(d_hi, t_odd), round), 1)), 7);
+		const __m128i stalled_lo = _mm_cmpeq_epi16(step_lo, zero);
+		const __m128i stalled_hi = _mm_cmpeq_epi16(step_hi, zero);
+
+		step_lo = _mm_or_si128(step_lo, _mm_and_si128(stalled_lo, d_lo));
+		step_hi = _mm_or_si128(step_hi, _mm_and_si128(stalled_hi, d_hi));
+		s_lo = _mm_add_epi16(s_lo, step_lo);
+		s_hi = _mm_add_epi16(s_hi, step_hi);
+
+		const __m128i result = _mm_packus_epi16(s_lo, s_hi);
+		_mm_storeu_si128((__m128i *)&colors[x], result);
+		converged &= _mm_movemask_epi8(_mm_cmpeq_epi32(result, end));
+	}
 
-	uint8_t e_r = (end_color >> 24) & 0xFF;
-	uint8_t e_g = (end_color >> 16) & 0xFF;
-	uint8_t e_b = (end_color >> 8) & 0xFF;
-	uint8_t e_a = (end_color >> 0) & 0xFF;
+	return converged == 0xFFFF;
+}
 
-	uint8_t ret_r = ((1-t)*s_r) + (t*e_r);
-	uint8_t ret_g = ((1-t)*s_g) + (t*e_g);
-	uint8_t ret_b = ((1-t)*s_b) + (t*e_b);
-	uint8_t ret_a = ((1-t)*s_a) + (t*e_a);
+__attribute__((target("avx2")))
+bool fade_row_avx2(uint32_t *colors, const uint64_t row0, const uint64_t row1,
+				   const uint32_t palette[4], const int16_t rate){
+	//Same math as fade_row_sse2, 8 pixels (32 channels) at a time
+	const __m256i color0 = _mm256_set1_epi32(palette[0]);
+	const __m256i color1 = _mm256_set1_epi32(palette[1]);
+	const __m256i color2 = _mm256_set1_epi32(palette[2]);
+	const __m256i color3 = _mm256_set1_epi32(palette[3]);
+	const __m256i lane_bits = _mm256_set_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m256i t_half = _mm256_set1_epi16(rate >> 1);
+	const __m256i t_odd = _mm256_set1_epi16(rate & 1);
+	const __m256i round = _mm256_set1_epi16(128);
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t converged = 0xFFFFFFFF;
+
+	for(uint8_t x = 0; x < 64; x += 8){
+		const __m256i bits0 = _mm256_and_si256(_mm256_set1_epi32((row0 >> (56 - x)) & 0xFF), lane_bits);
+		const __m256i bits1 = _mm256_and_si256(_mm256_set1_epi32((row1 >> (56 - x)) & 0xFF), lane_bits);
+		const __m256i lit0 = _mm256_cmpeq_epi32(bits0, lane_bits);
+		const __m256i lit1 = _mm256_cmpeq_epi32(bits1, lane_bits);
+		const __m256i end = _mm256_blendv_epi8(_mm256_blendv_epi8(color0, color1, lit0),
+											   _mm256_blendv_epi8(color2, color3, lit0), lit1);
+		const __m256i start = _mm256_loadu_si256((const __m256i *)&colors[x]);
+
+		__m256i s_lo = _mm256_unpacklo_epi8(start, zero);
+		__m256i s_hi = _mm256_unpackhi_epi8(start, zero);
+		const __m256i d_lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(end, zero), s_lo);
+		const __m256i d_hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(end, zero), s_hi);
+
+		__m256i step_lo = _mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(d_lo, t_half),
+							_mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(d_lo, t_odd), round), 1)), 7);
+		__m256i step_hi = _mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(d_hi, t_half),
+							_mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(d_hi, t_odd), round), 1)), 7);
+		const __m256i stalled_lo = _mm256_cmpeq_epi16(step_lo, zero);
+		const __m256i stalled_hi = _mm256_cmpeq_epi16(step_hi, zero);
+
+		step_lo = _mm256_or_si256(step_lo, _mm256_and_si256(stalled_lo, d_lo));
+		step_hi = _mm256_or_si256(step_hi, _mm256_and_si256(stalled_hi, d_hi));
+		s_lo = _mm256_add_epi16(s_lo, step_lo);
+		s_hi = _mm256_add_epi16(s_hi, step_hi);
+
+		//unpack and pack both work within 128-bit lanes, so the pixels come back in order
+		const __m256i result = _mm256_packus_epi16(s_lo, s_hi);
+		_mm256_storeu_si256((__m256i *)&colors[x], result);
+		converged &= (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(result, end));
+	}
 
-	return (ret_r << 24) | (ret_g << 16) | (ret_b << 8) | ret_a; 
+	return converged == 0xFFFFFFFF;
 }
+#endif
 
-void audio_callback(void *usedata, uint8_t *stream, int len){
-	config_t *config = (config_t *)usedata;
+fade_row_t select_fade_row(void){
+	//Pick the widest fade kernel this CPU runs
+#if defined(__x86_64__) || defined(__i386__)
+	if(SDL_HasAVX2()) return fade_row_avx2;
+	if(SDL_HasSSE2()) return fade_row_sse2;
+#endif
+	return fade_row_scalar;
+}
 
+void audio_callback(void *userdata, uint8_t *stream, int len){
+	//Runs on SDL's audio thread and touches nothing but the ring. When it runs dry (paused, rewinding,
+	//or the emulation fell behind) the last sample decays to silence instead of stopping dead
+	audio_ring_t *ring = userdata;
 	int16_t *audio_data = (int16_t *)stream;
-	static uint32_t running_sample_index = 0;
-	const int32_t square_wave_period = config->audio_sample_rate/config->square_wave_freq;
-	const uint32_t half_square_wave_period = square_wave_period/2;
-	
-	for(int i = 0; i < len/2; i++){
-		audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ? config->volume : -config->volume;
+	const uint32_t count = len / sizeof *audio_data;
+	const uint32_t tail = SDL_AtomicGet(&ring->tail);
+	const uint32_t available = (uint32_t)SDL_AtomicGet(&ring->head) - tail;
+	SDL_MemoryBarrierAcquire();	//Samples up to head are read only after head is
+	const uint32_t played = available < count ? available : count;
+
+	for(uint32_t i = 0; i < played; i++)
+		audio_data[i] = ring->samples[(tail + i) & (AUDIO_RING_SIZE - 1)];
+	if(played) ring->last = audio_data[played - 1];
+
+	for(uint32_t i = played; i < count; i++){
+		ring->last = ring->last * 15 / 16;
+		audio_data[i] = ring->last;
+	}
+
+	//The slots are read before tail hands them back to the writer
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&ring->tail, tail + played);
+}
+
+uint32_t audio_ring_write(audio_ring_t *ring, const int16_t *samples, const uint32_t count, const uint32_t max_buffered){
+	//Queue samples for the audio thread. Whatever would take it past max_buffered samples of latency is
+	//dropped, so a producer running ahead of the sound card can't build up a delay
+	const uint32_t head = SDL_AtomicGet(&ring->head);
+	const uint32_t buffered = head - (uint32_t)SDL_AtomicGet(&ring->tail);
+	SDL_MemoryBarrierAcquire();	//Slots freed by tail are overwritten only after tail is read
+	const uint32_t limit = max_buffered < AUDIO_RING_SIZE ? max_buffered : AUDIO_RING_SIZE;
+	const uint32_t written = buffered >= limit ? 0 : count < limit - buffered ? count : limit - buffered;
+
+	for(uint32_t i = 0; i < written; i++)
+		ring->samples[(head + i) & (AUDIO_RING_SIZE - 1)] = samples[i];
+
+	//Publishing head after the samples are in place is what hands them over
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&ring->head, head + written);
+	return written;
+}
+
+void init_synth(synth_t *synth, const config_t *config, const uint32_t sample_rate){
+	*synth = (synth_t){
+		.sample_rate = sample_rate,
+		.volume = config->volume,
+		.tone_step = (double)config->square_wave_freq / sample_rate,
+	};
+}
+
+double blep_after(double t, const double dt){
+	//PolyBLEP residual for a unit step at phase 0, the half just after it. Adding step/2 times this (and
+	//blep_before for the half before) to a hard edge rounds it off into an approximately band-limited one
+	if(t >= dt) return 0;
+	t /= dt;
+	return t + t - t*t - 1;
+}
+
+double blep_before(double t, const double dt){
+	if(t <= 1 - dt) return 0;
+	t = (t - 1) / dt;
+	return t*t + t + t + 1;
+}
+
+bool pattern_bit(const chip8_t *chip8, const uint32_t bit){
+	return (chip8->audio_pattern[(bit & 127) >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+void synth_render(synth_t *synth, const chip8_t *chip8, int16_t *out, const uint32_t count){
+	//The CHIP-8 square wave, or the XO-CHIP pattern's 128 bits MSB first at 4000*2^((pitch-64)/48) bits/s,
+	//gated by the sound timer. Every edge gets a PolyBLEP correction so it doesn't alias
+	const float target = chip8->sound_timer > 0;
+	const float gain_step = 500.0f / synth->sample_rate;
+	const double pattern_step = 4000 * SDL_pow(2, (chip8->pitch - 64) / 48.0) / synth->sample_rate;
+	//Past half a period per sample every sample is an edge, there's nothing left to smooth
+	const double tone_dt = synth->tone_step < 0.5 ? synth->tone_step : 0;
+	const double pattern_dt = pattern_step < 0.5 ? pattern_step : 0;
+
+	for(uint32_t i = 0; i < count; i++){
+		double value;
+
+		if(chip8->pattern_loaded){
+			const uint32_t bit = synth->pattern_phase;
+			const double t = synth->pattern_phase - bit;
+			const double prev = pattern_bit(chip8, bit - 1) ? 1 : -1;
+			const double cur = pattern_bit(chip8, bit) ? 1 : -1;
+			const double next = pattern_bit(chip8, bit + 1) ? 1 : -1;
+
+			value = cur + (cur - prev) / 2 * blep_after(t, pattern_dt) + (next - cur) / 2 * blep_before(t, pattern_dt);
+
+			synth->pattern_phase += pattern_step;
+			while(synth->pattern_phase >= 128) synth->pattern_phase -= 128;
+		}
+		else{
+			const double t = synth->tone_phase;
+			const double half = t < 0.5 ? t + 0.5 : t - 0.5;
+
+			//High for the first half period, low for the second: a rise at 0 and a fall at 0.5
+			value = t < 0.5 ? 1 : -1;
+			value += blep_after(t, tone_dt) + blep_before(t, tone_dt);
+			value -= blep_after(half, tone_dt) + blep_before(half, tone_dt);
+
+			synth->tone_phase += synth->tone_step;
+			while(synth->tone_phase >= 1) synth->tone_phase -= 1;
+		}
+
+		if(synth->gain < target) synth->gain = synth->gain + gain_step < target ? synth->gain + gain_step : target;
+		if(synth->gain > target) synth->gain = synth->gain - gain_step > target ? synth->gain - gain_step : target;
+
+		out[i] = value * synth->gain * synth->volume;
+	}
+}
+
+uint32_t synth_tick(synth_t *synth, const chip8_t *chip8, const double speed, int16_t *out, const uint32_t capacity){
+	//Render the sound of one 60Hz tick, taken before the timers tick down. At speed s a tick only lasts
+	//1/(60s) s of host time, so it gets that many samples: fast-forward shortens sounds rather than
+	//raising their pitch. Returns the sample count
+	synth->owed_samples += synth->sample_rate / (60 * speed);
+
+	uint32_t count = synth->owed_samples;
+	synth->owed_samples -= count;
+	if(count > capacity) count = capacity;
+
+	synth_render(synth, chip8, out, count);
+	return count;
+}
+
+bool init_outlines(sdl_t *sdl, const config_t *config, const bool hires){
+	//Pre-render the pixel outline grid once, in the background color, over a transparent texture.
+	//Hires pixels are half the size; when that's too small for an outline the grid is left out
+	const uint32_t width = config->window_width * config->scale_factor;
+	const uint32_t height = config->window_height * config->scale_factor;
+	const uint32_t scale = config->scale_factor >> hires;
+
+	if(scale < 3) return true;
+
+	uint32_t *pixels = calloc((size_t)width * height, sizeof *pixels);
+	if(!pixels){
+		SDL_Log("Could not allocate pixel outlines\n");
+		return false;
+	}
+
+	for(uint32_t y = 0; y < height; y++){
+		for(uint32_t x = 0; x < width; x++){
+			const uint32_t cell_x = x % scale;
+			const uint32_t cell_y = y % scale;
+
+			if(cell_x == 0 || cell_y == 0 || cell_x == scale-1 || cell_y == scale-1)
+				pixels[y*width + x] = config->bg_color;
+		}
+	}
+
+	SDL_Texture *outlines = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC,
+											  width, height);
+	sdl->outlines[hires] = outlines;
+
+	if(!outlines ||
+	   SDL_UpdateTexture(outlines, NULL, pixels, width * sizeof *pixels) != 0){
+		SDL_Log("Could not create SDL outline texture %s\n",SDL_GetError());
+		free(pixels);
+		return false;
 	}
+
+	free(pixels);
+	SDL_SetTextureBlendMode(outlines, SDL_BLENDMODE_BLEND);
+	return true;
 }
 
 bool init_sdl(sdl_t *sdl, config_t *config){	
@@ -113,20 +599,41 @@ bool init_sdl(sdl_t *sdl, config_t *config){
 		SDL_Log("Could not create SDL window %s\n",SDL_GetError());
 	}
 
-	sdl->renderer = SDL_CreateRenderer(sdl->window,-1,SDL_RENDERER_ACCELERATED);
+	sdl->renderer = SDL_CreateRenderer(sdl->window,-1,SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
 	if(!sdl->renderer){
 		SDL_Log("Could not create SDL renderer %s\n",SDL_GetError());
 		return false;
 	}
 
+	//The whole display is uploaded into one small texture and scaled up by a single copy.
+	//It's sized for hires, lores only uses its top left quarter
+	sdl->screen = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+									128, 64);
+
+	if(!sdl->screen){
+		SDL_Log("Could not create SDL screen texture %s\n",SDL_GetError());
+		return false;
+	}
+
+	if(config->pixel_outlines && (!init_outlines(sdl, config, false) || !init_outlines(sdl, config, true)))
+		return false;
+
+	sdl->fade_row = select_fade_row();
+
+	sdl->audio_ring = calloc(1, sizeof *sdl->audio_ring);
+	if(!sdl->audio_ring){
+		SDL_Log("Could not allocate the audio ring\n");
+		return false;
+	}
+
 	sdl->want = (SDL_AudioSpec){
-		.freq = 44100,
+		.freq = config->audio_sample_rate,
 		.channels = 1,
 		.format = AUDIO_S16LSB,
 		.samples = 512,
 		.callback = audio_callback,
-		.userdata = config
+		.userdata = sdl->audio_ring
 	};
 
 	sdl->dev = SDL_OpenAudioDevice(NULL, 0, &sdl->want, &sdl->have, 0);
@@ -142,31 +649,506 @@ bool init_sdl(sdl_t *sdl, config_t *config){
 		return false;
 	}
 
+	//The device plays for good, silence is just samples of 0
+	SDL_PauseAudioDevice(sdl->dev, 0);
+
+	return true;
+}
+
+typedef struct{
+	const char *name;	//The same options as the command line without the dashes
+	const char *value;	//NULL for flags
+}setting_t;
+
+#define MAX_LINE_SETTINGS 64
+
+struct rom_profile{
+	uint32_t rom_hash;
+	setting_t *settings;	//Split once when the database is loaded, pointing into its text
+	uint32_t setting_count;
+};
+
+bool option_takes_value(const char *name){
+	const char *flags[] = {"headless","scaling","superchip","xochip","rom-hash","decode-trace","debug"};
+
+	for(size_t f = 0; f < sizeof flags / sizeof flags[0]; f++){
+		if(strcmp(name,flags[f]) == 0) return false;
+	}
+	return true;
+}
+
+bool set_option(config_t *config, const char *name, const char *value){
+	//Every setting goes through here, whether it came from the command line, the config file or a ROM profile
+	const struct{const char *name; uint32_t quirk;} quirks[] = {
+		{"quirk-vf-reset",QUIRK_VF_RESET}, {"quirk-shift",QUIRK_SHIFT}, {"quirk-load-store",QUIRK_LOAD_STORE},
+		{"quirk-clip",QUIRK_CLIP}, {"quirk-jump",QUIRK_JUMP}
+	};
+
+	if(!value) value = "";
+
+	for(size_t q = 0; q < sizeof quirks / sizeof quirks[0]; q++){
+		if(strcmp(name,quirks[q].name) != 0) continue;
+
+		//Later settings win, so turning a quirk on also cancels an earlier off and vice versa
+		const bool on = strtoul(value,NULL,0) != 0;
+		config->quirks_on = on ? config->quirks_on | quirks[q].quirk : config->quirks_on & ~quirks[q].quirk;
+		config->quirks_off = on ? config->quirks_off & ~quirks[q].quirk : config->quirks_off | quirks[q].quirk;
+		return true;
+	}
+
+	if(strcmp(name,"ips") == 0) config->inst_per_sec = strtoul(value,NULL,0);
+	else if(strcmp(name,"scale") == 0) config->scale_factor = strtoul(value,NULL,0);
+	else if(strcmp(name,"fg") == 0) config->fg_color = strtoul(value,NULL,16);
+	else if(strcmp(name,"bg") == 0) config->bg_color = strtoul(value,NULL,16);
+	else if(strcmp(name,"fg2") == 0) config->fg2_color = strtoul(value,NULL,16);
+	else if(strcmp(name,"blend") == 0) config->blend_color = strtoul(value,NULL,16);
+	else if(strcmp(name,"outlines") == 0) config->pixel_outlines = strtoul(value,NULL,0) != 0;
+	else if(strcmp(name,"lerp") == 0) config->color_lerp_rate = strtof(value,NULL);
+	else if(strcmp(name,"volume") == 0) config->volume = strtol(value,NULL,0);
+	else if(strcmp(name,"tone") == 0) config->square_wave_freq = strtoul(value,NULL,0);
+	else if(strcmp(name,"superchip") == 0) config->current_extension = SUPERCHIP;
+	else if(strcmp(name,"xochip") == 0) config->current_extension = XOCHIP;
+	else if(strcmp(name,"extension") == 0){
+		if(strcmp(value,"chip8") == 0) config->current_extension = CHIP8;
+		else if(strcmp(value,"schip") == 0 || strcmp(value,"superchip") == 0) config->current_extension = SUPERCHIP;
+		else if(strcmp(value,"xochip") == 0) config->current_extension = XOCHIP;
+		else{
+			SDL_Log("Unknown extension %s\n",value);
+			return false;
+		}
+	}
+	else if(strcmp(name,"headless") == 0) config->headless = true;
+	else if(strcmp(name,"frames") == 0){
+		config->bench_frames = strtoul(value,NULL,0);
+		config->bench_insts = 0;
+	}
+	else if(strcmp(name,"insts") == 0){
+		config->bench_insts = strtoull(value,NULL,0);
+		config->bench_frames = 0;
+	}
+	else if(strcmp(name,"rewind-seconds") == 0) config->rewind_seconds = strtoul(value,NULL,0);
+	else if(strcmp(name,"rewind-memory") == 0){
+		//The rewind arena is addressed with 32-bit offsets
+		const unsigned long megabytes = strtoul(value,NULL,0);
+		if(megabytes >= 4096){
+			SDL_Log("Invalid value %s for %s, the most is 4095 MB\n",value,name);
+			return false;
+		}
+		config->rewind_memory = megabytes << 20;
+	}
+	else if(strcmp(name,"record") == 0) config->record_file = value;
+	else if(strcmp(name,"replay") == 0) config->replay_file = value;
+	else if(strcmp(name,"wav") == 0) config->wav_file = value;
+	else if(strcmp(name,"trace") == 0) config->trace_file = value;
+	else if(strcmp(name,"profile") == 0) config->profile_file = value;
+	else if(strcmp(name,"batch") == 0) config->batch_file = value;
+	else if(strcmp(name,"copies") == 0) config->batch_copies = strtoul(value,NULL,0);
+	else if(strcmp(name,"threads") == 0) config->batch_threads = strtoul(value,NULL,0);
+	else if(strcmp(name,"scaling") == 0) config->batch_scaling = true;
+	else if(strcmp(name,"rom-hash") == 0) config->print_rom_hash = true;
+	else if(strcmp(name,"decode-trace") == 0) config->decode_trace = true;
+	else if(strcmp(name,"debug") == 0) config->debug = true;
+	else if(strcmp(name,"gdb") == 0) config->gdb_port = strtoul(value,NULL,0);
+	else{
+		SDL_Log("Unknown option %s\n",name);
+		return false;
+	}
+
+	if(config->scale_factor == 0 || config->square_wave_freq == 0){
+		SDL_Log("Invalid value %s for %s\n",value,name);
+		return false;
+	}
+	return true;
+}
+
+char *next_token(char **cursor, const char *delimiters){
+	//strtok() that keeps its position in *cursor, so a line can be split into tokens while the file is still being split into lines
+	char *token = *cursor + strspn(*cursor,delimiters);
+	if(!*token){
+		*cursor = token;
+		return NULL;
+	}
+
+	char *end = token + strcspn(token,delimiters);
+	*cursor = *end ? end + 1 : end;
+	*end = '\0';
+	return token;
+}
+
+int split_settings(char *line, const char *source, setting_t *settings){
+	//A config file or profile line: whitespace separated "name=value" (or "name = value") tokens, # starts a comment.
+	//Split in place into at most MAX_LINE_SETTINGS settings, returns how many or -1 when the line is malformed.
+	//Names and values point into line, so it has to outlive config
+	char *comment = strchr(line,'#');
+	if(comment) *comment = '\0';
+
+	int count = 0;
+	char *cursor = line;
+	for(char *token = next_token(&cursor," \t\r\n"); token; token = next_token(&cursor," \t\r\n")){
+		char *value = strchr(token,'=');
+		if(value) *value++ = '\0';
+
+		//"name = value" splits into three tokens
+		if(value && !*value) value = next_token(&cursor," \t\r\n");
+		if(!value && option_takes_value(token)){
+			char *next = next_token(&cursor," \t\r\n");
+			if(next && *next == '=') next = next[1] ? next + 1 : next_token(&cursor," \t\r\n");
+			value = next;
+		}
+
+		if(option_takes_value(token) && !value){
+			SDL_Log("%s: %s needs a value\n",source,token);
+			return -1;
+		}
+		if(count == MAX_LINE_SETTINGS){
+			SDL_Log("%s: more than %d settings on one line\n",source,MAX_LINE_SETTINGS);
+			return -1;
+		}
+		settings[count++] = (setting_t){.name = token, .value = value};
+	}
+	return count;
+}
+
+bool apply_settings(config_t *config, const setting_t *settings, const uint32_t count, const char *source){
+	for(uint32_t s = 0; s < count; s++){
+		if(!set_option(config,settings[s].name,settings[s].value)){
+			SDL_Log("%s: invalid setting\n",source);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool set_options_from_line(config_t *config, char *line, const char *source){
+	setting_t settings[MAX_LINE_SETTINGS];
+	const int count = split_settings(line,source,settings);
+	return count >= 0 && apply_settings(config,settings,count,source);
+}
+
+bool apply_command_line(config_t *config, char **options, const int count){
+	//The options before the ROM names. --config and --profiles only name the files read before them
+	for(int o = 0; o < count; o++){
+		const char *name = options[o] + 2;
+		const bool has_value = option_takes_value(name);
+
+		if(strcmp(name,"config") != 0 && strcmp(name,"profiles") != 0 &&
+		   !set_option(config,name,has_value ? options[o+1] : NULL))
+			return false;
+		o += has_value;
+	}
+	return true;
+}
+
+char *read_text_file(const char *path){
+	FILE *file = fopen(path,"rb");
+	if(!file) return NULL;
+
+	fseek(file,0,SEEK_END);
+	const long size = ftell(file);
+	rewind(file);
+
+	char *text = size >= 0 ? malloc(size + 1) : NULL;
+	if(text && fread(text,1,size,file) != (size_t)size){
+		free(text);
+		text = NULL;
+	}
+	if(text) text[size] = '\0';
+
+	fclose(file);
+	return text;
+}
+
+bool load_config_file(config_t *config, const char *path, const bool required){
+	//The text stays allocated for the life of the process, string settings point into it
+	char *text = read_text_file(path);
+	if(!text){
+		if(required) SDL_Log("Config file %s is invalid or does not exist\n",path);
+		return !required;
+	}
+
+	char *cursor = text;
+	for(char *line = next_token(&cursor,"\n"); line; line = next_token(&cursor,"\n")){
+		if(!set_options_from_line(config,line,path)) return false;
+	}
+	return true;
+}
+
+int compare_profiles(const void *a, const void *b){
+	const uint32_t hash_a = ((const rom_profile_t *)a)->rom_hash;
+	const uint32_t hash_b = ((const rom_profile_t *)b)->rom_hash;
+	return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+bool load_profiles(config_t *config, const char *path, const bool required){
+	//Every line is "<rom hash in hex> name=value ...". Parsed once into an array sorted by hash, so
+	//looking a ROM up is a binary search. Lives for the life of the process like the config file
+	char *text = read_text_file(path);
+	if(!text){
+		if(required) SDL_Log("Profile database %s is invalid or does not exist\n",path);
+		return !required;
+	}
+
+	uint32_t capacity = 1;
+	for(const char *c = text; *c; c++) capacity += *c == '\n';
+
+	rom_profile_t *profiles = malloc(capacity * sizeof *profiles);
+	if(!profiles){
+		SDL_Log("Could not allocate profile database %s\n",path);
+		free(text);
+		return false;
+	}
+
+	uint32_t count = 0;
+	char *cursor = text;
+	for(char *line = next_token(&cursor,"\n"); line; line = next_token(&cursor,"\n")){
+		char *options;
+		const uint32_t hash = strtoul(line,&options,16);
+		if(options == line) continue;	//Blank or comment line
+
+		setting_t settings[MAX_LINE_SETTINGS];
+		const int setting_count = split_settings(options,path,settings);
+		setting_t *kept = setting_count > 0 ? malloc(setting_count * sizeof *kept) : NULL;
+		if(setting_count < 0 || (setting_count > 0 && !kept)){
+			if(setting_count > 0) SDL_Log("Could not allocate profile database %s\n",path);
+			for(uint32_t p = 0; p < count; p++) free(profiles[p].settings);
+			free(profiles);
+			free(text);
+			return false;
+		}
+		if(kept) memcpy(kept,settings,setting_count * sizeof *kept);
+
+		profiles[count++] = (rom_profile_t){.rom_hash = hash, .settings = kept, .setting_count = setting_count};
+	}
+
+	qsort(profiles,count,sizeof *profiles,compare_profiles);
+	config->profiles = profiles;
+	config->profile_count = count;
+	return true;
+}
+
+uint32_t fnv1a(uint32_t hash, const uint8_t *data, const size_t size);
+
+typedef struct{
+	//A ROM file's bytes, read once and shared by every path with the same contents
+	uint8_t *data;			//NULL for an empty file
+	size_t size;
+	uint32_t hash;			//FNV-1a of the bytes, the key into the profile database
+}rom_image_t;
+
+typedef struct{
+	char *path;
+	const rom_image_t *image;
+}rom_cache_entry_t;
+
+bool read_rom_image(const char *path, rom_image_t *image){
+	//Copied out of the file rather than mapped, so a ROM truncated on disk can't fault a later reset.
+	//The descriptor is closed on every path
+	const int fd = open(path, O_RDONLY);
+	if(fd < 0) return false;
+
+	struct stat info;
+	bool ok = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+	*image = (rom_image_t){.size = ok ? (size_t)info.st_size : 0};
+
+	if(ok && image->size){
+		size_t got = 0;
+		image->data = malloc(image->size);
+
+		while(image->data && got < image->size){
+			const ssize_t n = read(fd, image->data + got, image->size - got);
+			if(n <= 0) break;
+			got += n;
+		}
+		ok = image->data && got == image->size;
+	}
+	close(fd);
+
+	if(!ok){
+		free(image->data);
+		return false;
+	}
+	image->hash = fnv1a(2166136261u, image->data, image->size);
+	return true;
+}
+
+const rom_image_t *load_rom_image(const char *path){
+	//Process-wide ROM cache. A ROM is read from disk the first time its path is asked for, and every
+	//instance and reset after that copies straight from memory without touching the file again, so a
+	//ROM rebuilt while the emulator runs is picked up on the next start. Paths are matched as given, and
+	//files with the same contents share one image. Batch workers load concurrently, so the lists are
+	//only touched under the lock, and files are read outside it. Images live until the process exits
+	static SDL_SpinLock lock;
+	static rom_cache_entry_t *entries;
+	static uint32_t entry_count;
+	static rom_image_t **images;
+	static uint32_t image_count;
+	const rom_image_t *found = NULL;
+
+	SDL_AtomicLock(&lock);
+	for(uint32_t e = 0; e < entry_count && !found; e++)
+		if(strcmp(entries[e].path, path) == 0) found = entries[e].image;
+	SDL_AtomicUnlock(&lock);
+	if(found) return found;
+
+	rom_image_t loaded;
+	if(!read_rom_image(path, &loaded)) return NULL;
+
+	rom_image_t *image = malloc(sizeof *image);
+	char *name = strdup(path);
+	bool kept_image = false;
+	bool kept_name = false;
+
+	SDL_AtomicLock(&lock);
+	rom_cache_entry_t *grown_entries = realloc(entries, (entry_count + 1) * sizeof *entries);
+	if(grown_entries) entries = grown_entries;
+	rom_image_t **grown_images = realloc(images, (image_count + 1) * sizeof *images);
+	if(grown_images) images = grown_images;
+
+	//Another thread may have read the same path meanwhile, or the same bytes under another name
+	for(uint32_t e = 0; e < entry_count && !found; e++)
+		if(strcmp(entries[e].path, path) == 0) found = entries[e].image;
+
+	for(uint32_t i = 0; i < image_count && !found; i++){
+		if(images[i]->hash == loaded.hash && images[i]->size == loaded.size &&
+		   (!loaded.size || memcmp(images[i]->data, loaded.data, loaded.size) == 0))
+			found = images[i];
+	}
+
+	if(!found && image && grown_images){
+		*image = loaded;
+		images[image_count++] = image;
+		found = image;
+		kept_image = true;
+	}
+
+	if(found && grown_entries && name){
+		uint32_t e = 0;
+		while(e < entry_count && strcmp(entries[e].path, path) != 0) e++;
+
+		if(e == entry_count){
+			entries[entry_count++] = (rom_cache_entry_t){.path = name, .image = found};
+			kept_name = true;
+		}
+	}
+	SDL_AtomicUnlock(&lock);
+
+	//A duplicate of a cached image, or one left over when an allocation failed
+	if(!kept_image){
+		free(loaded.data);
+		free(image);
+	}
+	if(!kept_name) free(name);
+	return found;
+}
+
+bool hash_rom_file(const char *rom_name, uint32_t *hash){
+	//FNV-1a of the ROM file's bytes, the key into the profile database. Also brings the ROM into the
+	//cache, so looking up its profile already loaded it for init_chip8()
+	const rom_image_t *image = load_rom_image(rom_name);
+	if(!image) return false;
+
+	*hash = image->hash;
+	return true;
+}
+
+void resolve_config(config_t *config){
+	//Fill in what the extension decides unless a setting overrode it
+	const uint32_t default_quirks[] = {
+		[CHIP8] = QUIRK_VF_RESET | QUIRK_CLIP,
+		[SUPERCHIP] = QUIRK_SHIFT | QUIRK_LOAD_STORE | QUIRK_CLIP | QUIRK_JUMP,
+		[XOCHIP] = 0,
+	};
+	const uint32_t default_inst_per_sec[] = {[CHIP8] = 500, [SUPERCHIP] = 1800, [XOCHIP] = 60000};
+
+	config->quirks = (default_quirks[config->current_extension] | config->quirks_on) & ~config->quirks_off;
+	if(!config->inst_per_sec) config->inst_per_sec = default_inst_per_sec[config->current_extension];
+}
+
+bool config_for_rom(const config_t *base, const char *rom_name, config_t *config){
+	//base with rom_name's profile applied, then the command line again so it still wins over the profile
+	*config = *base;
+
+	uint32_t hash;
+	if(config->profile_count && hash_rom_file(rom_name,&hash)){
+		const rom_profile_t key = {.rom_hash = hash};
+		const rom_profile_t *profile = bsearch(&key,config->profiles,config->profile_count,
+											   sizeof *config->profiles,compare_profiles);
+
+		if(profile && (!apply_settings(config,profile->settings,profile->setting_count,rom_name) ||
+					   !apply_command_line(config,base->options,base->option_count)))
+			return false;
+	}
+
+	resolve_config(config);
 	return true;
 }
 
 bool set_config_from_args(config_t *config,const int argc, char **argv){
+	//Defaults, then the config file, then the command line. ROM profiles slot in between the last
+	//two in config_for_rom(), which also resolves what's left to the extension's defaults
 	*config = (config_t){
 		.window_width = 64,
 		.window_height = 32,
 		.fg_color = 0xFFFFFFFF,
 		.bg_color = 0x000000FF,
+		.fg2_color = 0xFF6600FF,
+		.blend_color = 0x662200FF,
 		.scale_factor = 20,
 		.pixel_outlines = true,
-		.inst_per_sec = 500,
 		.square_wave_freq = 440,
 		.audio_sample_rate = 44100,
 		.volume = 3000,
-		.color_lerp_rate = 0.7
+		.color_lerp_rate = 0.7,
+		.rewind_seconds = 30,
+		.rewind_memory = 8 << 20,
+		.bench_frames = 1000000,
+		.batch_copies = 1
 	};
 
-	for(int i=1;i<argc;i++){
-		(void)argv[i];
+	const char *config_file = NULL;
+	const char *profile_file = NULL;
+
+	int i = 1;
+	for(;i<argc && strncmp(argv[i],"--",2) == 0;i++){
+		const char *name = argv[i] + 2;
+
+		if(option_takes_value(name) && i+1 >= argc){
+			SDL_Log("Option %s needs a value\n",argv[i]);
+			return false;
+		}
+
+		if(strcmp(name,"config") == 0) config_file = argv[++i];
+		else if(strcmp(name,"profiles") == 0) profile_file = argv[++i];
+		else if(option_takes_value(name)) i++;
+	}
+
+	config->rom_names = &argv[i];
+	config->rom_count = argc - i;
+
+	//chip8.conf and chip8-profiles.txt in the working directory are picked up when they exist
+	if(!load_config_file(config, config_file ? config_file : "chip8.conf", config_file != NULL)) return false;
+	if(!load_profiles(config, profile_file ? profile_file : "chip8-profiles.txt", profile_file != NULL)) return false;
+
+	config->options = &argv[1];
+	config->option_count = i - 1;
+	if(!apply_command_line(config,config->options,config->option_count)) return false;
+
+	if(config->rom_count < 1 && !config->batch_file){
+		SDL_Log("No rom file given\n");
+		return false;
 	}
 
 	return true;
 }
 
+#define BIG_FONT_ADDRESS 0x50
+
+void free_chip8(chip8_t *chip8){
+	//Only XO-CHIP's 64KB RAM lives on the heap. Needed before init_chip8 reuses a machine
+	if(chip8->ram != chip8->ram_4k) free(chip8->ram);
+	chip8->ram = chip8->ram_4k;
+}
+
 bool init_chip8(chip8_t *chip8,const config_t config,const char rom_name[]){
 	const uint32_t entry_point = 0x200;
 	const uint8_t font[] = {
@@ -187,52 +1169,768 @@ bool init_chip8(chip8_t *chip8,const config_t config,const char rom_name[]){
 		0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
 		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 	};
+	const uint8_t big_font[] = {
+		0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+		0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+		0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+		0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+		0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+		0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+		0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+		0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+		0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+		0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+		0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+		0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+	};
 
-	memset(chip8, 0, sizeof(chip8_t));
-
-	memcpy(&chip8->ram[0],font,sizeof(font));
-
-	FILE *rom = fopen(rom_name,"rb");
+	//Everything that can fail comes before the machine is cleared, so a failed reset keeps it as it was.
+	//Only the first load of a ROM touches the disk, resets and further instances copy from the cache
+	const rom_image_t *rom = load_rom_image(rom_name);
 	if(!rom){
 		SDL_Log("Rom file %s is invalid or does not exist\n",rom_name);
 		return false;
 	}
 
-	fseek(rom,0,SEEK_END);
-	const size_t rom_size = ftell(rom);
-	const size_t max_size = sizeof chip8->ram - entry_point;
-	rewind(rom);
+	//XO-CHIP addresses 64KB, everything else gets by with the 4KB inside chip8_t
+	const size_t ram_size = config.current_extension == XOCHIP ? 0x10000 : sizeof chip8->ram_4k;
+	const size_t max_size = ram_size - entry_point;
 
-	if(rom_size>max_size){
+	if(rom->size>max_size){
 		SDL_Log("Rom file %s is too big! Rom size: %llu, Max size allowed: %llu\n",
-				rom_name,(long long unsigned)rom_size,(long long unsigned)max_size);
+				rom_name,(long long unsigned)rom->size,(long long unsigned)max_size);
 		return false;
 	}
 
-	if(fread(&chip8->ram[entry_point],rom_size,1,rom) != 1){
+	if(!rom->size){
 		SDL_Log("Could not read Rom file %s into CHIP8 memory\n",rom_name);
 		return false;
 	}
 
-	fclose(rom);
+	uint8_t *xo_ram = NULL;
+	if(config.current_extension == XOCHIP){
+		xo_ram = calloc(1, ram_size);
+		if(!xo_ram){
+			SDL_Log("Could not allocate XO-CHIP memory\n");
+			return false;
+		}
+	}
+
+	memset(chip8, 0, sizeof(chip8_t));
+	chip8->ram = xo_ram ? xo_ram : chip8->ram_4k;
+	chip8->ram_size = ram_size;
+
+	memcpy(&chip8->ram[0],font,sizeof(font));
+
+	//The 8x10 SCHIP digits for FX30 sit right after the small font, plain CHIP-8 leaves that RAM empty
+	if(config.current_extension != CHIP8)
+		memcpy(&chip8->ram[BIG_FONT_ADDRESS],big_font,sizeof(big_font));
+
+	memcpy(&chip8->ram[entry_point],rom->data,rom->size);
 
 	chip8->state = RUNNING;
 	chip8->PC = entry_point;
 	chip8->rom_name = rom_name;
 	chip8->stack_ptr = &chip8->stack[0];
-	memset(&chip8->pixel_color[0], config.bg_color, sizeof chip8->pixel_color);
+	chip8->key = 0xFF;
+	chip8->rng_state = config.rng_seed ? config.rng_seed : 0xC8;
+	chip8->planes = 1;
+	chip8->pitch = 64;
+	chip8->dirty_rows = ~0ull;
 
 	return true;
 }
 
-void final_cleanup(const sdl_t sdl){
-	SDL_DestroyRenderer(sdl.renderer);
-	SDL_DestroyWindow(sdl.window);
-	SDL_CloseAudioDevice(sdl.dev);
-	SDL_Quit();
+uint32_t fnv1a(uint32_t hash, const uint8_t *data, const size_t size){
+	for(size_t i = 0; i < size; i++){
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-void clear_screen(const config_t config,const sdl_t sdl){
+#define SAVE_STATE_MAGIC 0x53533843u	// "C8SS" read as little endian
+#define SAVE_STATE_VERSION 4
+#define SAVE_STATE_HEADER_SIZE (4 + 2 + 4 + 2+2 + 16 + 1 + 12*2 + 1+1 + 2 + 1+1 + 4 + 4 + 16 + 1 + 1 + 16+1+1 + 2*64*2*8)
+#define SAVE_STATE_MAX_SIZE (SAVE_STATE_HEADER_SIZE + 0x10000)
+
+typedef struct{
+	uint8_t data[SAVE_STATE_MAX_SIZE];
+	size_t size;
+}save_slot_t;
+
+size_t save_state_size(const chip8_t *chip8){
+	//Everything but RAM is a fixed size, RAM is 4KB or XO-CHIP's 64KB
+	return SAVE_STATE_HEADER_SIZE + chip8->ram_size;
+}
+
+void flush_blocks(chip8_t *chip8){
+	memset(chip8->block_len, 0, sizeof chip8->block_len);
+	memset(chip8->code_slot, false, sizeof chip8->code_slot);
+}
+
+void put_le(uint8_t **out, uint64_t value, uint8_t bytes){
+	for(uint8_t b = 0; b < bytes; b++, value >>= 8)
+		*(*out)++ = value & 0xFF;
+}
+
+uint64_t get_le(const uint8_t **in, uint8_t bytes){
+	uint64_t value = 0;
+	for(uint8_t b = 0; b < bytes; b++)
+		value |= (uint64_t)*(*in)++ << (8*b);
+	return value;
+}
+
+size_t save_state(const chip8_t *chip8, uint8_t *buffer, const size_t size){
+	//Serialize the whole machine into buffer, little endian, no allocation.
+	//Returns the number of bytes written, or 0 if buffer is too small
+	if(size < save_state_size(chip8)) return 0;
+
+	uint8_t *out = buffer;
+	uint16_t keypad = 0;
+
+	for(uint8_t k = 0; k < 16; k++)
+		keypad |= chip8->keypad[k] << k;
+
+	put_le(&out, SAVE_STATE_MAGIC, 4);
+	put_le(&out, SAVE_STATE_VERSION, 2);
+	put_le(&out, chip8->ram_size, 4);
+	put_le(&out, chip8->PC, 2);
+	put_le(&out, chip8->I, 2);
+	memcpy(out, chip8->V, sizeof chip8->V);
+	out += sizeof chip8->V;
+	put_le(&out, chip8->stack_ptr - chip8->stack, 1);
+	for(uint8_t s = 0; s < 12; s++)
+		put_le(&out, chip8->stack[s], 2);
+	put_le(&out, chip8->delay_timer, 1);
+	put_le(&out, chip8->sound_timer, 1);
+	put_le(&out, keypad, 2);
+	put_le(&out, chip8->key, 1);
+	put_le(&out, chip8->any_key_pressed, 1);
+	put_le(&out, chip8->rng_state, 4);
+	put_le(&out, chip8->cycle_fraction, 4);
+	memcpy(out, chip8->rpl, sizeof chip8->rpl);
+	out += sizeof chip8->rpl;
+	put_le(&out, chip8->hires, 1);
+	put_le(&out, chip8->planes, 1);
+	memcpy(out, chip8->audio_pattern, sizeof chip8->audio_pattern);
+	out += sizeof chip8->audio_pattern;
+	put_le(&out, chip8->pitch, 1);
+	put_le(&out, chip8->pattern_loaded, 1);
+	for(uint8_t plane = 0; plane < 2; plane++){
+		for(uint8_t y = 0; y < 64; y++){
+			put_le(&out, chip8->display[plane][y][0], 8);
+			put_le(&out, chip8->display[plane][y][1], 8);
+		}
+	}
+	memcpy(out, chip8->ram, chip8->ram_size);
+	out += chip8->ram_size;
+
+	return out - buffer;
+}
+
+bool load_state(chip8_t *chip8, const config_t *config, const uint8_t *buffer, const size_t size){
+	//Restore a save_state() blob. Only the decoded instructions whose RAM actually changed are dropped,
+	//so restoring costs about as much as saving. Everything the machine indexes with is checked before
+	//anything is restored, so a corrupt file leaves the machine as it was
+	const uint8_t *in = buffer;
+
+	if(size < SAVE_STATE_HEADER_SIZE || get_le(&in, 4) != SAVE_STATE_MAGIC){
+		SDL_Log("Not a save state\n");
+		return false;
+	}
+
+	const uint16_t version = get_le(&in, 2);
+	if(version != SAVE_STATE_VERSION){
+		SDL_Log("Unsupported save state version %u\n", version);
+		return false;
+	}
+
+	if(get_le(&in, 4) != chip8->ram_size || size < save_state_size(chip8)){
+		SDL_Log("Save state is for a different machine\n");
+		return false;
+	}
+
+	const uint16_t PC = get_le(&in, 2);
+	const uint16_t I = get_le(&in, 2);
+	const uint8_t *V = in;
+	in += sizeof chip8->V;
+	const uint8_t stack_depth = get_le(&in, 1);
+	const uint8_t *flags = &in[12*2 + 2 + 2];	//After the stack, both timers and the keypad
+	const uint8_t key = flags[0];				//FX0A indexes the keypad with it
+	const uint8_t hires = flags[1 + 1 + 4 + 4 + sizeof chip8->rpl];
+	const uint8_t planes = flags[1 + 1 + 4 + 4 + sizeof chip8->rpl + 1];
+
+	if(stack_depth > 12 || (key >= 16 && key != 0xFF) || PC >= chip8->ram_size || I >= chip8->ram_size ||
+	   hires > (config->current_extension != CHIP8) || planes > 3){
+		SDL_Log("Corrupt save state\n");
+		return false;
+	}
+
+	chip8->PC = PC;
+	chip8->I = I;
+	memcpy(chip8->V, V, sizeof chip8->V);
+	chip8->stack_ptr = &chip8->stack[stack_depth];
+	for(uint8_t s = 0; s < 12; s++)
+		chip8->stack[s] = get_le(&in, 2);
+	chip8->delay_timer = get_le(&in, 1);
+	chip8->sound_timer = get_le(&in, 1);
+	const uint16_t keypad = get_le(&in, 2);
+	for(uint8_t k = 0; k < 16; k++)
+		chip8->keypad[k] = (keypad >> k) & 1;
+	chip8->key = get_le(&in, 1);
+	chip8->any_key_pressed = get_le(&in, 1);
+	chip8->rng_state = get_le(&in, 4);
+	chip8->cycle_fraction = get_le(&in, 4);
+	memcpy(chip8->rpl, in, sizeof chip8->rpl);
+	in += sizeof chip8->rpl;
+	chip8->hires = get_le(&in, 1);
+	chip8->planes = get_le(&in, 1);
+	memcpy(chip8->audio_pattern, in, sizeof chip8->audio_pattern);
+	in += sizeof chip8->audio_pattern;
+	chip8->pitch = get_le(&in, 1);
+	chip8->pattern_loaded = get_le(&in, 1);
+	for(uint8_t plane = 0; plane < 2; plane++){
+		for(uint8_t y = 0; y < 64; y++){
+			chip8->display[plane][y][0] = get_le(&in, 8);
+			chip8->display[plane][y][1] = get_le(&in, 8);
+		}
+	}
+
+	//Neither is saved, both only hold between ticks of one run
+	chip8->waiting_for_key = false;
+	chip8->tick_left = 0;
+
+	const uint8_t *ram = in;
+	bool flush = false;
+	for(uint16_t slot = 0; slot < sizeof chip8->decoded / sizeof chip8->decoded[0]; slot++){
+		if(chip8->ram[slot*2] != ram[slot*2] || chip8->ram[slot*2+1] != ram[slot*2+1]){
+			chip8->decoded[slot].handler = NULL;
+			flush |= chip8->code_slot[slot];
+		}
+	}
+	if(flush) flush_blocks(chip8);
+
+	memcpy(chip8->ram, ram, chip8->ram_size);
+	chip8->dirty_rows = ~0ull;
+
+	return true;
+}
+
+bool save_state_file(const chip8_t *chip8, const char *path){
+	//A state is up to 64KB of RAM, too much for the emulation thread's stack
+	uint8_t *buffer = malloc(SAVE_STATE_MAX_SIZE);
+	if(!buffer){
+		SDL_Log("Could not allocate save state buffer\n");
+		return false;
+	}
+	const size_t size = save_state(chip8, buffer, SAVE_STATE_MAX_SIZE);
+
+	FILE *file = fopen(path,"wb");
+	const bool ok = file && fwrite(buffer, size, 1, file) == 1;
+	if(!ok) SDL_Log("Could not write save state %s\n",path);
+	if(file) fclose(file);
+
+	free(buffer);
+	return ok;
+}
+
+bool load_state_file(chip8_t *chip8, const config_t *config, const char *path){
+	FILE *file = fopen(path,"rb");
+	if(!file){
+		SDL_Log("Save state %s is invalid or does not exist\n",path);
+		return false;
+	}
+
+	uint8_t *buffer = malloc(SAVE_STATE_MAX_SIZE);
+	if(!buffer){
+		SDL_Log("Could not allocate save state buffer\n");
+		fclose(file);
+		return false;
+	}
+
+	const size_t size = fread(buffer, 1, SAVE_STATE_MAX_SIZE, file);
+	fclose(file);
+
+	const bool ok = load_state(chip8, config, buffer, size);
+	free(buffer);
+	return ok;
+}
+
+typedef struct{
+	uint32_t offset;
+	uint32_t size;
+	uint32_t key_seq;
+}rewind_frame_t;
+
+typedef struct{
+	uint8_t *data;
+	uint32_t capacity;
+	rewind_frame_t *frames;
+	uint32_t max_frames;
+	uint32_t oldest_seq;
+	uint32_t next_seq;
+	uint32_t keyframe_interval;
+	uint32_t key_seq;
+	bool force_keyframe;
+	uint32_t state_size;
+	uint8_t key_state[SAVE_STATE_MAX_SIZE];
+	uint8_t state[SAVE_STATE_MAX_SIZE];
+	uint8_t packed[SAVE_STATE_MAX_SIZE*3/2 + 2];	// worst case is alternating zero and non zero bytes
+}rewind_t;
+
+bool init_rewind(rewind_t *rewind, const config_t *config){
+	//Frames are kept in a fixed ring of rewind_seconds*60 entries, their packed bytes in a fixed
+	//rewind_memory byte arena. Nothing is allocated after this
+	memset(rewind, 0, sizeof *rewind);
+	rewind->max_frames = config->rewind_seconds * 60;
+	rewind->capacity = config->rewind_memory;
+	rewind->keyframe_interval = 60;
+	rewind->force_keyframe = true;
+
+	if(!rewind->max_frames) return true;
+
+	rewind->frames = calloc(rewind->max_frames, sizeof *rewind->frames);
+	rewind->data = malloc(rewind->capacity);
+
+	if(!rewind->frames || !rewind->data || rewind->capacity < sizeof rewind->packed){
+		SDL_Log("Could not allocate %u bytes of rewind buffer\n", rewind->capacity);
+		return false;
+	}
+	return true;
+}
+
+void free_rewind(rewind_t *rewind){
+	free(rewind->frames);
+	free(rewind->data);
+}
+
+uint32_t rle_xor_pack(uint8_t *out, const uint8_t *state, const uint8_t *base, const uint32_t size){
+	//Pack state XOR base (base NULL packs state itself) as <zero run><literal count><literals> records,
+	//runs and counts one byte each. Returns the packed size
+	uint32_t in = 0, packed = 0;
+
+	while(in < size){
+		uint32_t zeros = 0;
+		while(in < size && zeros < 255 && (state[in] ^ (base ? base[in] : 0)) == 0){
+			zeros++;
+			in++;
+		}
+
+		uint32_t literals = 0;
+		while(in + literals < size && literals < 255 && (state[in + literals] ^ (base ? base[in + literals] : 0)) != 0)
+			literals++;
+
+		out[packed++] = zeros;
+		out[packed++] = literals;
+		for(uint32_t l = 0; l < literals; l++, in++)
+			out[packed++] = state[in] ^ (base ? base[in] : 0);
+	}
+
+	return packed;
+}
+
+void rle_xor_unpack(uint8_t *state, const uint8_t *in, const uint32_t packed){
+	//XOR a rle_xor_pack() record stream into state
+	uint32_t out = 0;
+
+	for(uint32_t p = 0; p + 1 < packed; ){
+		out += in[p++];
+		const uint8_t literals = in[p++];
+
+		for(uint8_t l = 0; l < literals; l++)
+			state[out++] ^= in[p++];
+	}
+}
+
+rewind_frame_t *rewind_frame(rewind_t *rewind, const uint32_t seq){
+	return &rewind->frames[seq % rewind->max_frames];
+}
+
+void evict_rewind_group(rewind_t *rewind){
+	//Drop the oldest keyframe together with all the deltas packed against it
+	do{
+		rewind->oldest_seq++;
+	}while(rewind->oldest_seq != rewind->next_seq &&
+		   rewind_frame(rewind, rewind->oldest_seq)->key_seq != rewind->oldest_seq);
+}
+
+void capture_rewind(rewind_t *rewind, const chip8_t *chip8){
+	//Once per frame: snapshot, pack as a delta against the last keyframe and append to the ring,
+	//evicting the oldest frames when the ring or the arena is full
+	if(!rewind->max_frames) return;
+
+	rewind->state_size = save_state(chip8, rewind->state, sizeof rewind->state);
+
+	const uint32_t seq = rewind->next_seq;
+	const bool keyframe = rewind->force_keyframe || seq % rewind->keyframe_interval == 0;
+	const uint32_t size = rle_xor_pack(rewind->packed, rewind->state, keyframe ? NULL : rewind->key_state,
+									   rewind->state_size);
+
+	uint32_t offset = 0;
+	while(rewind->oldest_seq != rewind->next_seq){
+		if(rewind->next_seq - rewind->oldest_seq >= rewind->max_frames){
+			evict_rewind_group(rewind);
+			continue;
+		}
+
+		const rewind_frame_t *newest = rewind_frame(rewind, rewind->next_seq - 1);
+		const uint32_t tail = rewind_frame(rewind, rewind->oldest_seq)->offset;
+		const uint32_t head = newest->offset + newest->size;
+
+		if(head > tail){
+			//Not wrapped: append after the newest frame, or wrap to the start if that fits before the oldest
+			if(rewind->capacity - head >= size){ offset = head; break; }
+			if(tail >= size){ offset = 0; break; }
+		}
+		else if(tail - head >= size){
+			offset = head;
+			break;
+		}
+
+		evict_rewind_group(rewind);
+	}
+
+	//A delta whose keyframe was just evicted can't be decoded, start a new group instead
+	if(!keyframe && rewind->key_seq < rewind->oldest_seq){
+		rewind->force_keyframe = true;
+		capture_rewind(rewind, chip8);
+		return;
+	}
+
+	if(keyframe){
+		memcpy(rewind->key_state, rewind->state, rewind->state_size);
+		rewind->key_seq = seq;
+		rewind->force_keyframe = false;
+	}
+
+	memcpy(&rewind->data[offset], rewind->packed, size);
+	*rewind_frame(rewind, seq) = (rewind_frame_t){.offset = offset, .size = size, .key_seq = rewind->key_seq};
+	rewind->next_seq++;
+}
+
+bool step_rewind(rewind_t *rewind, chip8_t *chip8, const config_t *config){
+	//The newest captured frame is the current state, so drop it and restore the one before it,
+	//which then becomes the newest. Each call steps exactly one frame back.
+	//The live keypad is kept since keys held during the snapshot may have been released since
+	if(rewind->next_seq - rewind->oldest_seq < 2) return false;
+
+	const uint32_t seq = --rewind->next_seq - 1;
+	const rewind_frame_t *frame = rewind_frame(rewind, seq);
+	const rewind_frame_t *key = rewind_frame(rewind, frame->key_seq);
+
+	memset(rewind->state, 0, rewind->state_size);
+	rle_xor_unpack(rewind->state, &rewind->data[key->offset], key->size);
+	if(frame->key_seq != seq)
+		rle_xor_unpack(rewind->state, &rewind->data[frame->offset], frame->size);
+
+	bool keypad[16];
+	memcpy(keypad, chip8->keypad, sizeof keypad);
+	load_state(chip8, config, rewind->state, rewind->state_size);
+	memcpy(chip8->keypad, keypad, sizeof keypad);
+
+	//The cached keyframe may be gone, so the next capture starts a fresh group
+	rewind->force_keyframe = true;
+	return true;
+}
+
+#define MOVIE_MAGIC 0x564D3843u	// "C8MV" read as little endian
+#define MOVIE_VERSION 3
+
+typedef struct{
+	uint32_t rng_seed;
+	uint32_t inst_per_sec;
+	extension_t extension;
+	uint32_t quirks;
+	uint32_t rom_hash;
+	uint32_t frame_count;
+	uint32_t capacity;
+	uint16_t *keys;
+}movie_t;
+
+uint16_t keypad_mask(const chip8_t *chip8){
+	uint16_t keys = 0;
+	for(uint8_t k = 0; k < 16; k++)
+		keys |= chip8->keypad[k] << k;
+	return keys;
+}
+
+void set_keypad_mask(chip8_t *chip8, const uint16_t keys){
+	for(uint8_t k = 0; k < 16; k++)
+		chip8->keypad[k] = (keys >> k) & 1;
+}
+
+uint32_t hash_rom(const chip8_t *chip8){
+	//Identifies the loaded ROM in a movie; taken right after init_chip8 so RAM holds just font + ROM
+	return fnv1a(2166136261u, chip8->ram, chip8->ram_size);
+}
+
+bool record_movie_frame(movie_t *movie, const uint16_t keys){
+	//Keys held at the start of every emulated frame, one mask per frame while recording
+	if(movie->frame_count == movie->capacity){
+		const uint32_t capacity = movie->capacity ? movie->capacity * 2 : 60*60;
+		uint16_t *grown = realloc(movie->keys, capacity * sizeof *grown);
+		if(!grown){
+			SDL_Log("Could not grow input movie\n");
+			return false;
+		}
+		movie->keys = grown;
+		movie->capacity = capacity;
+	}
+
+	movie->keys[movie->frame_count++] = keys;
+	return true;
+}
+
+void fput_le(FILE *file, uint64_t value, uint8_t bytes){
+	for(uint8_t b = 0; b < bytes; b++, value >>= 8)
+		fputc(value & 0xFF, file);
+}
+
+uint64_t fget_le(FILE *file, uint8_t bytes){
+	uint64_t value = 0;
+	for(uint8_t b = 0; b < bytes; b++)
+		value |= (uint64_t)(fgetc(file) & 0xFF) << (8*b);
+	return value;
+}
+
+typedef struct{
+	//Headless sound output: the same synth as the audio device, rendered at exactly 60 ticks a second
+	FILE *file;
+	synth_t synth;
+	uint32_t samples;
+}wav_t;
+
+void write_wav_header(wav_t *wav){
+	//44 byte RIFF header for 16-bit mono PCM
+	fputs("RIFF", wav->file);
+	fput_le(wav->file, 36 + wav->samples*2, 4);
+	fputs("WAVEfmt ", wav->file);
+	fput_le(wav->file, 16, 4);
+	fput_le(wav->file, 1, 2);
+	fput_le(wav->file, 1, 2);
+	fput_le(wav->file, wav->synth.sample_rate, 4);
+	fput_le(wav->file, wav->synth.sample_rate*2, 4);
+	fput_le(wav->file, 2, 2);
+	fput_le(wav->file, 16, 2);
+	fputs("data", wav->file);
+	fput_le(wav->file, wav->samples*2, 4);
+}
+
+bool open_wav(wav_t *wav, const char *path, const config_t *config){
+	wav->file = fopen(path,"wb");
+	if(!wav->file){
+		SDL_Log("Could not write WAV file %s\n",path);
+		return false;
+	}
+
+	init_synth(&wav->synth, config, config->audio_sample_rate);
+	wav->samples = 0;
+	write_wav_header(wav);
+	return true;
+}
+
+bool close_wav(wav_t *wav){
+	//The sizes are only known now, so the header is written again over the placeholder
+	rewind(wav->file);
+	write_wav_header(wav);
+
+	const bool ok = !ferror(wav->file);
+	fclose(wav->file);
+
+	if(!ok) SDL_Log("Could not write WAV file\n");
+	return ok;
+}
+
+bool save_movie(const movie_t *movie, const char *path){
+	//Header, then the key masks as <frames u32><keys u16> runs since keys rarely change between frames
+	FILE *file = fopen(path,"wb");
+	if(!file){
+		SDL_Log("Could not write input movie %s\n",path);
+		return false;
+	}
+
+	uint32_t runs = 0;
+	for(uint32_t f = 0; f < movie->frame_count; f++)
+		runs += f == 0 || movie->keys[f] != movie->keys[f-1];
+
+	fput_le(file, MOVIE_MAGIC, 4);
+	fput_le(file, MOVIE_VERSION, 2);
+	fput_le(file, movie->rng_seed, 4);
+	fput_le(file, movie->inst_per_sec, 4);
+	fput_le(file, movie->extension, 1);
+	fput_le(file, movie->quirks, 1);
+	fput_le(file, movie->rom_hash, 4);
+	fput_le(file, movie->frame_count, 4);
+	fput_le(file, runs, 4);
+
+	for(uint32_t f = 0; f < movie->frame_count; ){
+		uint32_t run = 1;
+		while(f + run < movie->frame_count && movie->keys[f + run] == movie->keys[f]) run++;
+
+		fput_le(file, run, 4);
+		fput_le(file, movie->keys[f], 2);
+		f += run;
+	}
+
+	const bool ok = !ferror(file);
+	fclose(file);
+
+	if(!ok) SDL_Log("Could not write input movie %s\n",path);
+	return ok;
+}
+
+bool load_movie(movie_t *movie, const char *path){
+	FILE *file = fopen(path,"rb");
+	if(!file){
+		SDL_Log("Input movie %s is invalid or does not exist\n",path);
+		return false;
+	}
+
+	memset(movie, 0, sizeof *movie);
+
+	if(fget_le(file, 4) != MOVIE_MAGIC || fget_le(file, 2) != MOVIE_VERSION){
+		SDL_Log("%s is not a supported input movie\n",path);
+		fclose(file);
+		return false;
+	}
+
+	movie->rng_seed = fget_le(file, 4);
+	movie->inst_per_sec = fget_le(file, 4);
+	movie->extension = fget_le(file, 1);
+	movie->quirks = fget_le(file, 1);
+	movie->rom_hash = fget_le(file, 4);
+	const uint32_t frame_count = fget_le(file, 4);
+	const uint32_t runs = fget_le(file, 4);
+
+	//The extension indexes the per-extension tables once the movie's settings are applied
+	if(movie->extension > XOCHIP){
+		SDL_Log("Input movie %s is for an unknown extension %u\n",path,movie->extension);
+		fclose(file);
+		return false;
+	}
+
+	movie->keys = malloc((frame_count ? frame_count : 1) * sizeof *movie->keys);
+	movie->capacity = frame_count;
+
+	for(uint32_t r = 0; movie->keys && r < runs && !feof(file); r++){
+		const uint32_t run = fget_le(file, 4);
+		const uint16_t keys = fget_le(file, 2);
+
+		for(uint32_t f = 0; f < run && movie->frame_count < frame_count; f++)
+			movie->keys[movie->frame_count++] = keys;
+	}
+
+	fclose(file);
+
+	if(!movie->keys || movie->frame_count != frame_count){
+		SDL_Log("Input movie %s is truncated\n",path);
+		free(movie->keys);
+		movie->keys = NULL;
+		return false;
+	}
+	return true;
+}
+
+typedef enum{
+	COMMAND_PAUSE = 1 << 0,		//Toggles
+	COMMAND_RESET = 1 << 1,
+	COMMAND_SAVE = 1 << 2,
+	COMMAND_LOAD = 1 << 3,
+	COMMAND_QUIT = 1 << 4,
+	COMMAND_TRACE = 1 << 5,		//Toggles, the trace is written out when it stops
+	COMMAND_PROFILE = 1 << 6,	//Toggles, the same for the profile
+	COMMAND_BREAK = 1 << 7,
+}command_t;
+
+#define GDB_PACKET_SIZE 4096
+
+typedef struct{
+	//GDB remote serial protocol on a loopback socket. The core polls it between batches, so a connected
+	//debugger costs no syscall per instruction. Breakpoints, watchpoints and stepping are the debugger's
+	int listener;			//-1 without --gdb
+	int client;				//-1 while no debugger is connected
+	debugger_t *debugger;
+	char in[GDB_PACKET_SIZE];
+	size_t in_len;
+	bool waiting;			//A c or s is waiting for its stop reply
+	uint8_t stop_signal;	//5 (SIGTRAP) for breakpoints and steps, 2 (SIGINT) for Ctrl-C
+}gdb_stub_t;
+
+#define FRAME_FRESH 4
+
+typedef struct{
+	uint64_t display[2][64][2];
+	bool hires;
+	uint32_t input_seq;		//The newest keypad change the core had run a tick with when it made this frame
+}frame_t;
+
+typedef struct{
+	//Triple buffered frames from the core to the presenter. The core fills back and publishes it by
+	//swapping it with middle, the presenter swaps middle for front whenever a fresh one is waiting.
+	//Neither side ever waits for the other, and the presenter always gets the newest complete frame
+	frame_t frames[3];
+	SDL_atomic_t middle;	//Index of the middle frame, plus FRAME_FRESH until the presenter takes it
+	int back;				//Core only
+	int front;				//Presenter only
+}frame_buffer_t;
+
+typedef struct{
+	//The emulation thread's state. The main thread only talks to it through the atomics and the frames
+	chip8_t chip8;
+	config_t config;
+	save_slot_t save_slot;
+	rewind_t rewind;
+	movie_t movie;
+	bool recording;
+	synth_t synth;
+	audio_ring_t *audio_ring;
+	debugger_t debugger;		//Its prompt reads stdin on the emulation thread
+	gdb_stub_t gdb;
+
+	SDL_atomic_t keys;			//Keypad bitmask
+	SDL_atomic_t input_seq;		//Bumped after every keypad change
+	SDL_atomic_t commands;		//command_t bits the core hasn't picked up yet
+	SDL_atomic_t rewinding;
+	SDL_atomic_t fast_forward;
+	SDL_atomic_t speed;			//In 1/8ths, 1 to 64
+	SDL_sem *wake;				//Posted with every change, so a sleeping core reacts at once
+	frame_buffer_t frames;
+	Uint32 frame_event;			//Pushed to the main thread when a frame is published
+	SDL_atomic_t frame_event_pending;
+}frontend_t;
+
+typedef struct{
+	//The main thread's side: what's on screen, and the input to photon latency of key presses
+	uint32_t pixel_color[128*64];
+	uint64_t shown[2][64][2];	//The display the colors are fading towards
+	bool hires;
+	uint64_t fade_rows;
+	bool repaint;
+	uint32_t pending_seq;		//Key press waiting for the display to change, 0 for none
+	uint64_t pending_time;
+	uint32_t latency_count;
+	double latency_total;
+	double latency_min;
+	double latency_max;
+}screen_t;
+
+void final_cleanup(const sdl_t sdl){
+	if(sdl.outlines[0]) SDL_DestroyTexture(sdl.outlines[0]);
+	if(sdl.outlines[1]) SDL_DestroyTexture(sdl.outlines[1]);
+	if(sdl.screen) SDL_DestroyTexture(sdl.screen);
+	SDL_DestroyRenderer(sdl.renderer);
+	SDL_DestroyWindow(sdl.window);
+	SDL_CloseAudioDevice(sdl.dev);
+	free(sdl.audio_ring);
+	SDL_Quit();
+}
+
+void clear_screen(const config_t config,const sdl_t sdl){
 	uint8_t r = (config.bg_color >> 24) & 0xFF;
 	uint8_t g = (config.bg_color >> 16) & 0xFF;
 	uint8_t b = (config.bg_color >> 8) & 0xFF;
@@ -242,761 +1940,3460 @@ void clear_screen(const config_t config,const sdl_t sdl){
 	SDL_RenderClear(sdl.renderer);
 }
 
-void update_screen(const sdl_t sdl,const config_t config, chip8_t *chip8){
-	SDL_Rect rect = {.x = 0, .y =0, .w = config.scale_factor, .h = config.scale_factor};
+bool update_screen(const sdl_t sdl,const config_t config, screen_t *screen, const uint64_t dirty_rows){
+	//Fade the rows that changed plus the ones still fading, compositing the planes on the way,
+	//upload only those rows and present. Does nothing at all when no row changed, returns whether a frame was presented
+	const float lerp_rate = config.color_lerp_rate * 256 + 0.5f;
+	const int16_t rate = lerp_rate > 255 ? 255 : lerp_rate < 0 ? 0 : lerp_rate;
+	const uint32_t width = screen->hires ? 128 : 64;
+	const uint32_t height = screen->hires ? 64 : 32;
+	const uint64_t all_rows = height < 64 ? (1ull << height) - 1 : ~0ull;
+	const uint64_t update_rows = (dirty_rows | screen->fade_rows) & all_rows;
+	const uint32_t palette[4] = {config.bg_color, config.fg_color, config.fg2_color, config.blend_color};
+
+	screen->fade_rows = update_rows;
+
+	if(!update_rows) return false;
+
+	for(uint32_t y = 0; y < height; y++){
+		if(!((update_rows >> y) & 1)) continue;
+
+		//Each fade call covers one 64 pixel word of the row
+		bool converged = true;
+		for(uint32_t word = 0; word < width/64; word++)
+			converged &= sdl.fade_row(&screen->pixel_color[y*128 + word*64], screen->shown[0][y][word],
+									  screen->shown[1][y][word], palette, rate);
+
+		if(converged)
+			screen->fade_rows &= ~(1ull << y);
+	}
+
+	//Upload each run of consecutive updated rows as one rect
+	for(uint32_t y = 0; y < height; ){
+		if(!((update_rows >> y) & 1)){
+			y++;
+			continue;
+		}
+
+		uint32_t end = y;
+		while(end < height && ((update_rows >> end) & 1)) end++;
+
+		const SDL_Rect rows = {.x = 0, .y = y, .w = width, .h = end - y};
+		SDL_UpdateTexture(sdl.screen, &rows, &screen->pixel_color[y*128],
+						  128 * sizeof screen->pixel_color[0]);
+		y = end;
+	}
+
+	const SDL_Rect display = {.x = 0, .y = 0, .w = width, .h = height};
+	SDL_RenderCopy(sdl.renderer, sdl.screen, &display, NULL);
+
+	if(config.pixel_outlines && sdl.outlines[screen->hires])
+		SDL_RenderCopy(sdl.renderer, sdl.outlines[screen->hires], NULL, NULL);
+
+	SDL_RenderPresent(sdl.renderer);
+	return true;
+}
+
+void present_frame(const sdl_t sdl, const config_t config, frontend_t *frontend, screen_t *screen){
+	//Take the newest published frame if there is one, and present whatever changed or is still fading.
+	//Frames the presenter never saw are skipped, so the changed rows come from comparing with the last one
+	frame_buffer_t *frames = &frontend->frames;
+	uint64_t dirty_rows = screen->repaint ? ~0ull : 0;
+
+	if(SDL_AtomicGet(&frames->middle) & FRAME_FRESH){
+		//The old front is done with before the swap hands it back, and the new one is read only after it
+		SDL_MemoryBarrierRelease();
+		frames->front = SDL_AtomicSet(&frames->middle, frames->front) & 3;
+		SDL_MemoryBarrierAcquire();
+		const frame_t *frame = &frames->frames[frames->front];
+
+		if(frame->hires != screen->hires) dirty_rows = ~0ull;
+		for(uint32_t y = 0; y < 64; y++){
+			const bool changed = ((frame->display[0][y][0] ^ screen->shown[0][y][0]) |
+								  (frame->display[0][y][1] ^ screen->shown[0][y][1]) |
+								  (frame->display[1][y][0] ^ screen->shown[1][y][0]) |
+								  (frame->display[1][y][1] ^ screen->shown[1][y][1])) != 0;
+			dirty_rows |= (uint64_t)changed << y;
+		}
+
+		memcpy(screen->shown, frame->display, sizeof screen->shown);
+		screen->hires = frame->hires;
+
+		//A key press is answered by the first change to the display after a tick that saw it
+		if(screen->pending_seq && dirty_rows && (int32_t)(frame->input_seq - screen->pending_seq) >= 0){
+			update_screen(sdl,config,screen,dirty_rows);
+
+			const double latency = (SDL_GetPerformanceCounter() - screen->pending_time) * 1000.0 / SDL_GetPerformanceFrequency();
+			screen->latency_total += latency;
+			if(!screen->latency_count || latency < screen->latency_min) screen->latency_min = latency;
+			if(latency > screen->latency_max) screen->latency_max = latency;
+			screen->latency_count++;
+			screen->pending_seq = 0;
+			screen->repaint = false;
+			return;
+		}
+	}
+
+	update_screen(sdl,config,screen,dirty_rows);
+	screen->repaint = false;
+}
+
+void stop_recording(frontend_t *frontend){
+	//Resets and state loads can't be replayed from the key masks, so the movie ends before them
+	if(frontend->recording)
+		SDL_Log("Input movie recording stopped at frame %u\n", frontend->movie.frame_count);
+	frontend->recording = false;
+}
+
+void send_command(frontend_t *frontend, const command_t command){
+	int commands;
+	do{
+		commands = SDL_AtomicGet(&frontend->commands);
+	}while(!SDL_AtomicCAS(&frontend->commands, commands, commands | command));
+
+	SDL_SemPost(frontend->wake);
+}
+
+int8_t keypad_key(const SDL_Keycode key){
+	//The CHIP-8 key for a keyboard key, or -1
+	switch(key){
+		case SDLK_1 : return 0x1;
+		case SDLK_2 : return 0x2;
+		case SDLK_3 : return 0x3;
+		case SDLK_4 : return 0xC;
+
+		case SDLK_q : return 0x4;
+		case SDLK_w : return 0x5;
+		case SDLK_e : return 0x6;
+		case SDLK_r : return 0xD;
+
+		case SDLK_a : return 0x7;
+		case SDLK_s : return 0x8;
+		case SDLK_d : return 0x9;
+		case SDLK_f : return 0xE;
+
+		case SDLK_z : return 0xA;
+		case SDLK_x : return 0x0;
+		case SDLK_c : return 0xB;
+		case SDLK_v : return 0xF;
+		default : return -1;
+	}
+}
+
+bool handle_event(const SDL_Event *event, frontend_t *frontend, screen_t *screen){
+	//Main thread: turn one SDL event into keypad bits and commands for the core. Returns false on quit
+	if(event->type == frontend->frame_event){
+		SDL_AtomicSet(&frontend->frame_event_pending, 0);
+		return true;
+	}
+
+	switch(event->type){
+		case SDL_QUIT : 
+			return false;
+
+		case SDL_WINDOWEVENT :
+			//Presents are skipped while nothing changes, so repaint everything when the window is exposed
+			if(event->window.event == SDL_WINDOWEVENT_EXPOSED)
+				screen->repaint = true;
+			break;
+
+		case SDL_KEYDOWN : 
+			switch(event->key.keysym.sym){
+				case SDLK_SPACE : send_command(frontend, COMMAND_PAUSE); break;
+				case SDLK_EQUALS : send_command(frontend, COMMAND_RESET); break;
+				case SDLK_F5 : send_command(frontend, COMMAND_SAVE); break;
+				case SDLK_F9 : send_command(frontend, COMMAND_LOAD); break;
+				case SDLK_F2 : send_command(frontend, COMMAND_TRACE); break;
+				case SDLK_F3 : send_command(frontend, COMMAND_PROFILE); break;
+				case SDLK_F4 : send_command(frontend, COMMAND_BREAK); break;
+
+				case SDLK_BACKSPACE :
+					//Backspace : Play backwards for as long as it's held
+					SDL_AtomicSet(&frontend->rewinding, 1);
+					SDL_SemPost(frontend->wake);
+					break;
+
+				case SDLK_TAB :
+					//Tab : Fast forward for as long as it's held
+					SDL_AtomicSet(&frontend->fast_forward, 1);
+					break;
+
+				case SDLK_LEFTBRACKET :
+				case SDLK_RIGHTBRACKET : {
+					//[ / ] : Halve / double the emulation speed, between 1/8x and 8x
+					int speed = SDL_AtomicGet(&frontend->speed);
+					if(event->key.keysym.sym == SDLK_LEFTBRACKET && speed > 1) speed /= 2;
+					if(event->key.keysym.sym == SDLK_RIGHTBRACKET && speed < 64) speed *= 2;
+					SDL_AtomicSet(&frontend->speed, speed);
+					SDL_Log("Speed %gx\n", speed / 8.0);
+					break;
+				}
+				default : break;
+			}
+			break;
+
+		case SDL_KEYUP :
+			switch(event->key.keysym.sym){
+				case SDLK_BACKSPACE : SDL_AtomicSet(&frontend->rewinding, 0); break;
+				case SDLK_TAB : SDL_AtomicSet(&frontend->fast_forward, 0); break;
+				default : break;
+			}
+			break;
+
+		default : 
+			break;
+	}
+
+	const int8_t key = event->type == SDL_KEYDOWN || event->type == SDL_KEYUP ? keypad_key(event->key.keysym.sym) : -1;
+	if(key >= 0){
+		//The keypad bits go first and the sequence after, so a core that sees the new sequence sees the keys
+		const int keys = SDL_AtomicGet(&frontend->keys);
+		const int updated = event->type == SDL_KEYDOWN ? keys | 1 << key : keys & ~(1 << key);
+
+		if(updated != keys){
+			SDL_AtomicSet(&frontend->keys, updated);
+			const uint32_t seq = SDL_AtomicAdd(&frontend->input_seq, 1) + 1;
+			SDL_SemPost(frontend->wake);
+
+			//A press the display never answered within half a second doesn't count, the next one replaces it
+			const uint64_t now = SDL_GetPerformanceCounter();
+			if(event->type == SDL_KEYDOWN &&
+			   (!screen->pending_seq || now - screen->pending_time > SDL_GetPerformanceFrequency() / 2)){
+				screen->pending_seq = seq ? seq : 1;
+				screen->pending_time = now;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool handle_input(frontend_t *frontend, screen_t *screen, const bool block){
+	//Drain the event queue, first waiting for an event if block is set. Returns false on quit
+	SDL_Event event;
+
+	if(block && SDL_WaitEvent(&event) && !handle_event(&event, frontend, screen))
+		return false;
+
+	while(SDL_PollEvent(&event)){
+		if(!handle_event(&event, frontend, screen)) return false;
+	}
+	return true;
+}
+
+void print_instruction(FILE *out, const chip8_t *chip8, const uint16_t address, const instruction_t *inst){
+	//One line describing inst at address, with the values it reads from chip8 as it was before running it
+	fprintf(out,"Address: 0x%04X, Opcode: 0x%04X Desc: ",address,inst->opcode);
+
+	switch((inst->opcode>>12) & 0x0F){
+		case 0x00 :
+			if(inst->NN == 0xE0){
+				//0x00E0 : Clear the screen
+				fprintf(out,"Clear the screen\n");
+			}
+			else if(inst->NN == 0xEE){
+				//0x00EE : Return from subroutine
+				fprintf(out,"Return from subroutine to address 0x%04X\n",
+						chip8->stack_ptr > chip8->stack ? *(chip8->stack_ptr - 1) : 0);
+			}
+			else if((inst->NN & 0xF0) == 0xC0){
+				//0x00CN : Scroll the display down N rows
+				fprintf(out,"Scroll the display down N (%u) rows\n",inst->N);
+			}
+			else if((inst->NN & 0xF0) == 0xD0){
+				//0x00DN : Scroll the display up N rows
+				fprintf(out,"Scroll the display up N (%u) rows\n",inst->N);
+			}
+			else if(inst->NN == 0xFB){
+				//0x00FB : Scroll the display right 4 pixels
+				fprintf(out,"Scroll the display right 4 pixels\n");
+			}
+			else if(inst->NN == 0xFC){
+				//0x00FC : Scroll the display left 4 pixels
+				fprintf(out,"Scroll the display left 4 pixels\n");
+			}
+			else if(inst->NN == 0xFD){
+				//0x00FD : Exit the interpreter
+				fprintf(out,"Exit the interpreter\n");
+			}
+			else if(inst->NN == 0xFE){
+				//0x00FE : Switch to 64x32 lores
+				fprintf(out,"Switch to 64x32 lores\n");
+			}
+			else if(inst->NN == 0xFF){
+				//0x00FF : Switch to 128x64 hires
+				fprintf(out,"Switch to 128x64 hires\n");
+			}
+			else
+				fprintf(out,"unimplemented\n");
+			break;
+		
+		case 0x01:
+			//0x1NNN : Jump to address NNN
+			fprintf(out,"Jump to address NNN (0x%04X)\n",inst->NNN);
+			break;
+
+		case 0x02 :
+			//0x2NNN : Call subroutine at NNN
+			fprintf(out,"Call subroutine at 0x%04X\n", inst->NNN);
+			break;
+
+		case 0x03 : 
+			//0x3XNN : if(VX == NN) skip next instruction
+			fprintf(out,"if V%X (0x%02X) == NN (0x%02X) skip next instruction\n",
+					inst->X,chip8->V[inst->X],inst->NN);
+			break;
+		
+		case 0x04 : 
+			//0x4XNN : if(VX != NN) skip next instruction
+			fprintf(out,"if V%X (0x%02X) != NN (0x%02X) skip next instruction\n",
+					inst->X,chip8->V[inst->X],inst->NN);
+			break;
+		
+		case 0x05 : 
+			if(inst->N == 2){
+				//0x5XY2 : Store VX - VY inclusive at I
+				fprintf(out,"Store V%X - V%X inclusive at I (0x%04X)\n",inst->X,inst->Y,chip8->I);
+			}
+			else if(inst->N == 3){
+				//0x5XY3 : Load VX - VY inclusive from I
+				fprintf(out,"Load V%X - V%X inclusive from I (0x%04X)\n",inst->X,inst->Y,chip8->I);
+			}
+			else{
+				//0x5XY0 : if(VX == VY) skip next instruction
+				fprintf(out,"if V%X (0x%02X) == V%X (0x%02X) skip next instruction\n",
+						inst->X,chip8->V[inst->X],inst->Y,chip8->V[inst->Y]);
+			}
+			break;
+
+		case 0x06 :
+			//0x6xNN : Set register VX to NN
+			fprintf(out,"Set register V%X to NN (0x%02X)\n", inst->X, inst->NN);
+			break;
+
+		case 0x07 :
+			//0x7xNN : Set register VX += NN
+			fprintf(out,"Set register V%X (0x%02X) += NN (0x%02X). Result : 0x%02X\n",
+				    inst->X,chip8->V[inst->X], inst->NN,
+					(uint8_t)(chip8->V[inst->X] + inst->NN));
+			break;
+
+		case 0x08 :
+			switch(inst->N){
+				case 0 :
+					//0x8XY0 : Set register VX to VY
+					fprintf(out,"Set register V%X == V%X (0x%02X)\n",
+				    		inst->X,inst->Y,chip8->V[inst->Y]);
+					break;
+
+				case 1 :
+					//0x8XY1 : Set register VX |= VY
+					fprintf(out,"Set register V%X (0x%02X) |= V%X (0x%02X). Result : 0x%02X\n",
+							inst->X,chip8->V[inst->X],
+							inst->Y,chip8->V[inst->Y],
+							chip8->V[inst->X] | chip8->V[inst->Y]);
+					break;	
+				
+				case 2 :
+					//0x8XY2 : Set register VX &= VY
+					fprintf(out,"Set register V%X (0x%02X) &= V%X (0x%02X). Result : 0x%02X\n",
+							inst->X,chip8->V[inst->X],
+							inst->Y,chip8->V[inst->Y],
+							chip8->V[inst->X] & chip8->V[inst->Y]);
+					break;
+
+				case 3 :
+					//0x8XY3 : Set register VX ^= VY
+					fprintf(out,"Set register V%X (0x%02X) ^= V%X (0x%02X). Result : 0x%02X\n",
+							inst->X,chip8->V[inst->X],
+							inst->Y,chip8->V[inst->Y],
+							chip8->V[inst->X] ^ chip8->V[inst->Y]);
+					break;
+
+				case 4 :
+					//0x8XY4 : Set register VX += VY and VF = 1 if carry
+					fprintf(out,"Set register V%X (0x%02X) += V%X (0x%02X). Result : 0x%02X, VF = %X\n",
+							inst->X,chip8->V[inst->X],
+							inst->Y,chip8->V[inst->Y],
+							(uint8_t)(chip8->V[inst->X] + chip8->V[inst->Y]),
+							((uint16_t)(chip8->V[inst->X] + chip8->V[inst->Y]) > 255));
+					break;
+				
+				case 5 :
+					//0x8XY5 : Set register VX -= VY and VF = 1 if no borrow
+					fprintf(out,"Set register V%X (0x%02X) -= V%X (0x%02X). Result : 0x%02X, VF = %X\n",
+							inst->X,chip8->V[inst->X],
+							inst->Y,chip8->V[inst->Y],
+							(uint8_t)(chip8->V[inst->X] - chip8->V[inst->Y]),
+							(chip8->V[inst->X] >= chip8->V[inst->Y]));
+					break;
+
+				case 6 :
+					//0x8XY6 : Set register VX >>= 1, store shifted bit in VF
+					fprintf(out,"Set register V%X (0x%02X) >>= 1. Result : 0x%02X, VF = %X\n",
+							inst->X,chip8->V[inst->X],
+							chip8->V[inst->X] >> 1,
+							chip8->V[inst->X] & 1);
+					break;
+				
+				case 7 :
+					//0x8XY7 : Set register VX = VY - VX and VF = 1 if no borrow
+					fprintf(out,"Set register V%X = V%X (0x%02X) - V%X (0x%02X). Result : 0x%02X, VF = %X\n",
+							inst->X,
+							inst->Y,chip8->V[inst->Y],
+							inst->X,chip8->V[inst->X],
+							(uint8_t)(chip8->V[inst->Y] - chip8->V[inst->X]),
+							(chip8->V[inst->X] <= chip8->V[inst->Y]));
+					break;
+
+				case 0xE :
+					//0x8XYE : Set register VX <<= 1, store shifted bit in VF
+					fprintf(out,"Set register V%X (0x%02X) <<= 1. Result : 0x%02X, VF = %X\n",
+							inst->X,chip8->V[inst->X],
+							(uint8_t)(chip8->V[inst->X] << 1),
+							(chip8->V[inst->X] & 0x80) >> 7);
+					break;
+
+				default :
+					break;
+			}
+			break;
+
+		case 0x09 : 
+			//0x9XY0 : if VX != VY skip the next instruction
+			fprintf(out,"if V%X (0x%02X) != V%X (0x%02X) skip next instruction\n",
+					inst->X,chip8->V[inst->X],
+					inst->Y,chip8->V[inst->Y]);
+			break;
+		
+		case 0x0A :
+			//0xANNN : Set index register I to NNN
+			fprintf(out,"Set I to NNN (0x%04X)\n",inst->NNN);
+			break;
+
+		case 0x0B :
+			//0xBNNN : Jump to V0 + NNN
+			fprintf(out,"Set PC to V0 (0x%02X) + NNN (0x%04X). Result : 0x%04X\n",
+				   chip8->V[0],inst->NNN,
+				   chip8->V[0] + inst->NNN);
+			break;
+		
+		case 0x0C : 
+			//0xCXNN : Setx VX = random byte & NN
+			fprintf(out,"Setx V%X = random byte & NN (0x%02X)\n",inst->X,inst->NN);
+			break;
+
+		case 0x0D :
+			//0xDXYN : Draw N-height sprite at coords X,Y; Read from I
+			fprintf(out,"Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) , Read from I (0x%04X)\n",
+					inst->N, inst->X,chip8->V[inst->X],inst->Y,
+					chip8->V[inst->Y],chip8->I);
+			break;
+
+		case 0x0E :
+			if(inst->NN == 0x9E){
+				//0xEX9E : Skip next instruction if key in VX is pressed 
+				fprintf(out,"Skip next instruction if key in V%X (0x%02X) is pressed, key : %d\n",
+						inst->X,chip8->V[inst->X],
+						chip8->keypad[chip8->V[inst->X] & 0xF]);
+			}
+			else if(inst->NN == 0xA1){
+				//0xEX9E : Skip next instruction if key in VX is not pressed 
+				fprintf(out,"Skip next instruction if key in V%X (0x%02X) is not pressed, key : %d\n",
+						inst->X,chip8->V[inst->X],
+						chip8->keypad[chip8->V[inst->X] & 0xF]);
+			}
+			break;
+
+		case 0x0F : 
+			switch(inst->NN){
+				case 0x00 :
+					//0xF000 NNNN : I = NNNN
+					fprintf(out,"I = NNNN (0x%04X)\n",(chip8->ram[(address + 2) & (chip8->ram_size - 1)] << 8) |
+							chip8->ram[(address + 3) & (chip8->ram_size - 1)]);
+					break;
+
+				case 0x01 :
+					//0xFN01 : Select planes N
+					fprintf(out,"Select planes %X\n",inst->X & 3);
+					break;
+
+				case 0x02 :
+					//0xF002 : Load the audio pattern from I
+					fprintf(out,"Load the 16 byte audio pattern from I (0x%04X)\n",chip8->I);
+					break;
+
+				case 0x3A :
+					//0xFX3A : Pitch = VX
+					fprintf(out,"Pitch = V%X (0x%02X)\n",inst->X,chip8->V[inst->X]);
+					break;
+
+				case 0x0A :
+					//0xFX0A : VX = get_key(); Await until a keypress, and store in VX
+					fprintf(out,"Await until a keypress, and store in V%X\n",inst->X);
+					break;
+
+				case 0x1E :
+						//0xFX1E : I += VX
+						fprintf(out,"I (0x%04X) += V%X (0x%02X). Result : 0x%04X\n",
+								chip8->I,inst->X,chip8->V[inst->X],
+								chip8->I + chip8->V[inst->X]);
+						break;
+
+				case 0x07 :
+						//0xFX07 : VX = delay timer
+						fprintf(out,"V%X = delay timer (0x%02X)\n",inst->X,chip8->delay_timer);
+						break;
+
+				case 0x15 :
+						//0xFX15 : delay timer = VX
+						fprintf(out,"delay timer = V%X (0x%02X)\n",inst->X,chip8->V[inst->X]);
+						break;
+				
+				case 0x18 :
+						//0xFX18 : sound timer = VX
+						fprintf(out,"sound timer = V%X (0x%02X)\n",inst->X,chip8->V[inst->X]);;
+						break;
+				
+				case 0x29 :
+						//0xFX29 : I = sprite location in VX
+						fprintf(out,"I = sprite location in V%X (0x%02X). Result = (0x%02X)\n",
+						inst->X, chip8->V[inst->X], chip8->V[inst->X] * 5);
+						break;
+
+				case 0x30 :
+						//0xFX30 : I = big sprite location in VX
+						fprintf(out,"I = big sprite location in V%X (0x%02X). Result = (0x%02X)\n",
+						inst->X, chip8->V[inst->X], BIG_FONT_ADDRESS + (chip8->V[inst->X] & 0xF) * 10);
+						break;
+
+				case 0x33 :
+					//0xFX33 : Store BCD representation of VX at memory offset from I
+					fprintf(out,"Store BCD representation of V%X (0x%02X) at memory offset from I (0x%04X)\n",
+							inst->X, chip8->V[inst->X],chip8->I);
+					break;
+
+				case 0x55 :
+					//0xFX55 : Register dumpp V0 - VX inclusive to memory offset from I
+					fprintf(out,"Register dumpp V0 - V%X (0x%02X) inclusive at memory offset from I (0x%04X)\n",
+							inst->X, chip8->V[inst->X],chip8->I);
+					break;
+
+				case 0x65 :
+					//0xFX65 : Register load V0 - VX inclusive from memory offset from I
+					fprintf(out,"Register load V0 - V%X (0x%02X) inclusive at memory offset from I (0x%04X)\n",
+							inst->X, chip8->V[inst->X],chip8->I);
+					break;
+
+				case 0x75 :
+					//0xFX75 : Save V0 - VX inclusive to the RPL user flags
+					fprintf(out,"Save V0 - V%X inclusive to the RPL user flags\n",inst->X);
+					break;
+
+				case 0x85 :
+					//0xFX85 : Load V0 - VX inclusive from the RPL user flags
+					fprintf(out,"Load V0 - V%X inclusive from the RPL user flags\n",inst->X);
+					break;
+
+				default : 
+					break;
+			}
+			break;
+
+		default :
+			fprintf(out,"unimplemented\n");
+	}
+}
+
+static inline void trace_instruction(trace_t *trace, const uint32_t count, const chip8_t *chip8,
+									 const uint16_t PC, const instruction_t *inst){
+	//One fixed size store per instruction and no formatting, the decoder does that offline.
+	//The caller keeps count in a register and stores it back to trace->count once it's done
+	trace->entries[count & (TRACE_SIZE - 1)] = (trace_entry_t){
+		.PC = PC, .opcode = inst->opcode, .I = chip8->I, .X = inst->X, .VX = chip8->V[inst->X]
+	};
+}
+
+bool start_trace(chip8_t *chip8){
+	//Tracing can be switched on and off at any point, the ring only exists while it's on
+	if(chip8->trace) return true;
+
+	chip8->trace = malloc(sizeof *chip8->trace);
+	if(!chip8->trace){
+		SDL_Log("Could not allocate the trace buffer\n");
+		return false;
+	}
+	chip8->trace->count = 0;
+	return true;
+}
+
+void stop_trace(chip8_t *chip8){
+	free(chip8->trace);
+	chip8->trace = NULL;
+}
+
+bool save_trace(const chip8_t *chip8, FILE *file){
+	//Append the last TRACE_SIZE entries, oldest first, for --decode-trace. Dumps can follow one another in a file
+	const trace_t *trace = chip8->trace;
+	if(!trace) return true;
+
+	const uint32_t count = trace->count < TRACE_SIZE ? trace->count : TRACE_SIZE;
+
+	fput_le(file, TRACE_MAGIC, 4);
+	fput_le(file, TRACE_VERSION, 2);
+	fput_le(file, count, 4);
+
+	for(uint32_t e = trace->count - count; e != trace->count; e++){
+		const trace_entry_t *entry = &trace->entries[e & (TRACE_SIZE - 1)];
+		fput_le(file, e, 4);
+		fput_le(file, entry->PC, 2);
+		fput_le(file, entry->opcode, 2);
+		fput_le(file, entry->I, 2);
+		fput_le(file, entry->X, 1);
+		fput_le(file, entry->VX, 1);
+	}
+
+	return !ferror(file);
+}
+
+bool save_trace_file(const chip8_t *chip8, const char *path){
+	FILE *file = fopen(path,"wb");
+	const bool ok = file && save_trace(chip8, file);
+
+	if(file) fclose(file);
+	if(!ok) SDL_Log("Could not write trace %s\n",path);
+	else SDL_Log("Wrote trace %s\n",path);
+	return ok;
+}
+
+uint8_t read_ram(const chip8_t *chip8, const uint32_t address){
+	//Addresses wrap at the end of RAM, 4KB or 64KB
+	return chip8->ram[address & (chip8->ram_size - 1)];
+}
+
+void watch_write(debugger_t *debugger, const uint16_t address, const uint8_t old, const uint8_t value){
+	//Remember the first watched store, the debugger breaks before the next instruction
+	if(debugger->watch_hit || !((debugger->watchpoints[address >> 3] >> (address & 7)) & 1)) return;
+
+	debugger->watch_hit = true;
+	debugger->watch_address = address;
+	debugger->watch_old = old;
+	debugger->watch_new = value;
+	debugger->watch_PC = debugger->last_PC;
+}
+
+void write_ram(chip8_t *chip8, uint32_t address, const uint8_t value){
+	//Every RAM store goes through here so stale decoded instructions and blocks are dropped
+	address &= chip8->ram_size - 1;
+
+	if(chip8->debugger) watch_write(chip8->debugger, address, chip8->ram[address], value);
+
+	chip8->ram[address] = value;
+
+	if(address >= sizeof chip8->ram_4k) return;
+
+	chip8->decoded[address >> 1].handler = NULL;
+
+	if(chip8->code_slot[address >> 1])
+		flush_blocks(chip8);
+}
+
+bool start_profile(chip8_t *chip8){
+	//Like tracing, profiling is switched on and off at run time and costs a pointer test per block while off
+	if(chip8->profile) return true;
+
+	chip8->profile = calloc(1, sizeof *chip8->profile);
+	if(!chip8->profile){
+		SDL_Log("Could not allocate the profile\n");
+		return false;
+	}
+	chip8->profile->node_count = 1;
+	return true;
+}
+
+void stop_profile(chip8_t *chip8){
+	free(chip8->profile);
+	chip8->profile = NULL;
+}
+
+uint32_t profile_child(profile_t *profile, const uint32_t parent, const uint16_t address){
+	//The call stack node for calling address from parent, added the first time that call is made.
+	//Node 0 is never a child, so it marks an empty hash slot
+	const uint32_t mask = sizeof profile->node_hash / sizeof profile->node_hash[0] - 1;
+	uint32_t slot = ((parent * 2654435761u) ^ address) & mask;
+
+	for(; profile->node_hash[slot]; slot = (slot + 1) & mask){
+		const uint32_t node = profile->node_hash[slot];
+		if(profile->nodes[node].parent == parent && profile->nodes[node].address == address) return node;
+	}
+
+	//Out of nodes, deeper calls are counted in their caller
+	if(profile->node_count == PROFILE_MAX_NODES) return parent;
+
+	const uint32_t node = profile->node_count++;
+	profile->nodes[node] = (profile_node_t){.parent = parent, .address = address};
+	profile->node_hash[slot] = node;
+	return node;
+}
+
+void profile_draw(profile_t *profile, const chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//The sprite bytes DXYN read, the same ones op_DXYN_body() goes over, before clipping
+	const bool big = inst->N == 0 && config->current_extension != CHIP8;
+	const uint8_t bytes = big ? 32 : inst->N;
+	uint16_t address = chip8->I;
+
+	profile->draws++;
+
+	for(uint8_t plane = 0; plane < 2; plane++){
+		if(!((chip8->planes >> plane) & 1)) continue;
+
+		for(uint8_t b = 0; b < bytes; b++)
+			profile->draw_lit += __builtin_popcount(read_ram(chip8, address + b));
+
+		profile->draw_pixels += bytes * 8;
+		address += bytes;
+	}
+}
+
+static inline void profile_instruction(profile_t *profile, const chip8_t *chip8, const config_t *config,
+									   const uint16_t PC, const instruction_t *inst){
+	//Counted after the instruction ran, so a call or return already moved to the stack it leads to
+	profile->opcodes[inst->opcode]++;
+	profile->pcs[PC]++;
+	profile->nodes[profile->current].count++;
+
+	switch(inst->opcode >> 12){
+		case 0x00 :
+			if(inst->opcode == 0x00EE) profile->current = profile->nodes[profile->current].parent;
+			break;
+		case 0x02 :
+			profile->current = profile_child(profile, profile->current, inst->NNN);
+			break;
+		case 0x0D :
+			profile_draw(profile, chip8, inst, config);
+			break;
+		default :
+			break;
+	}
+}
+
+void profile_frame(profile_t *profile, const uint32_t insts){
+	if(!profile->frames || insts < profile->frame_min) profile->frame_min = insts;
+	if(insts > profile->frame_max) profile->frame_max = insts;
+	profile->frame_insts += insts;
+	profile->frames++;
+}
+
+typedef struct{
+	uint64_t count;
+	uint32_t key;
+}profile_count_t;
+
+int compare_profile_counts(const void *a, const void *b){
+	//Most executed first
+	const uint64_t x = ((const profile_count_t *)a)->count;
+	const uint64_t y = ((const profile_count_t *)b)->count;
+	return (x < y) - (x > y);
+}
+
+bool write_profile(const chip8_t *chip8, FILE *report, FILE *folded){
+	//A report sorted by cost, and the call stacks as folded stacks ("rom;sub_0280;sub_02A4 count"),
+	//the input format of flamegraph.pl, speedscope and most other flame graph tools
+	const struct{uint16_t mask; uint16_t match; const char *name;} classes[] = {
+		{0xFFFF,0x00E0,"00E0 clear"}, {0xFFFF,0x00EE,"00EE return"}, {0xFFF0,0x00C0,"00CN scroll down"},
+		{0xFFF0,0x00D0,"00DN scroll up"}, {0xFFFF,0x00FB,"00FB scroll right"}, {0xFFFF,0x00FC,"00FC scroll left"},
+		{0xFFFF,0x00FD,"00FD exit"}, {0xFFFF,0x00FE,"00FE lores"}, {0xFFFF,0x00FF,"00FF hires"},
+		{0xF000,0x1000,"1NNN jump"}, {0xF000,0x2000,"2NNN call"}, {0xF000,0x3000,"3XNN skip if VX == NN"},
+		{0xF000,0x4000,"4XNN skip if VX != NN"}, {0xF00F,0x5000,"5XY0 skip if VX == VY"},
+		{0xF00F,0x5002,"5XY2 store VX - VY"}, {0xF00F,0x5003,"5XY3 load VX - VY"}, {0xF000,0x6000,"6XNN VX = NN"},
+		{0xF000,0x7000,"7XNN VX += NN"}, {0xF00F,0x8000,"8XY0 VX = VY"}, {0xF00F,0x8001,"8XY1 VX |= VY"},
+		{0xF00F,0x8002,"8XY2 VX &= VY"}, {0xF00F,0x8003,"8XY3 VX ^= VY"}, {0xF00F,0x8004,"8XY4 VX += VY"},
+		{0xF00F,0x8005,"8XY5 VX -= VY"}, {0xF00F,0x8006,"8XY6 VX >>= 1"}, {0xF00F,0x8007,"8XY7 VX = VY - VX"},
+		{0xF00F,0x800E,"8XYE VX <<= 1"}, {0xF00F,0x9000,"9XY0 skip if VX != VY"}, {0xF000,0xA000,"ANNN I = NNN"},
+		{0xF000,0xB000,"BNNN jump V0 + NNN"}, {0xF000,0xC000,"CXNN random"}, {0xF000,0xD000,"DXYN draw"},
+		{0xF0FF,0xE09E,"EX9E skip if key"}, {0xF0FF,0xE0A1,"EXA1 skip if no key"}, {0xFFFF,0xF000,"F000 I = NNNN"},
+		{0xF0FF,0xF001,"FN01 planes"}, {0xFFFF,0xF002,"F002 audio pattern"}, {0xF0FF,0xF007,"FX07 VX = delay"},
+		{0xF0FF,0xF00A,"FX0A wait for key"}, {0xF0FF,0xF015,"FX15 delay = VX"}, {0xF0FF,0xF018,"FX18 sound = VX"},
+		{0xF0FF,0xF01E,"FX1E I += VX"}, {0xF0FF,0xF029,"FX29 font"}, {0xF0FF,0xF030,"FX30 big font"},
+		{0xF0FF,0xF033,"FX33 BCD"}, {0xF0FF,0xF03A,"FX3A pitch"}, {0xF0FF,0xF055,"FX55 store V0 - VX"},
+		{0xF0FF,0xF065,"FX65 load V0 - VX"}, {0xF0FF,0xF075,"FX75 save flags"}, {0xF0FF,0xF085,"FX85 load flags"},
+		{0x0000,0x0000,"invalid"}
+	};
+	const uint32_t class_count = sizeof classes / sizeof classes[0];
+	const uint32_t hot_pcs = 32;
+	const profile_t *profile = chip8->profile;
+	if(!profile) return true;
+
+	profile_count_t counts[sizeof classes / sizeof classes[0]];
+	profile_count_t *pcs = malloc(0x10000 * sizeof *pcs);
+	if(!pcs){
+		SDL_Log("Could not allocate the profile report\n");
+		return false;
+	}
+
+	uint64_t total = 0;
+	uint32_t pc_count = 0;
+
+	for(uint32_t c = 0; c < class_count; c++)
+		counts[c] = (profile_count_t){.key = c};
+
+	for(uint32_t opcode = 0; opcode < 0x10000; opcode++){
+		if(!profile->opcodes[opcode]) continue;
+
+		uint32_t c = 0;
+		while((opcode & classes[c].mask) != classes[c].match) c++;
+		counts[c].count += profile->opcodes[opcode];
+		total += profile->opcodes[opcode];
+	}
+
+	for(uint32_t address = 0; address < 0x10000; address++){
+		if(profile->pcs[address])
+			pcs[pc_count++] = (profile_count_t){.count = profile->pcs[address], .key = address};
+	}
+
+	qsort(counts, class_count, sizeof counts[0], compare_profile_counts);
+	qsort(pcs, pc_count, sizeof pcs[0], compare_profile_counts);
+
+	const double percent = total ? 100.0 / total : 0;
+
+	fprintf(report, "Profile of %s: %llu instructions in %llu frames\n", chip8->rom_name,
+			(long long unsigned)total, (long long unsigned)profile->frames);
+	if(profile->frames)
+		fprintf(report, "Instructions per frame: %u min, %.1f average, %u max\n", profile->frame_min,
+				(double)profile->frame_insts / profile->frames, profile->frame_max);
+	if(profile->draws)
+		fprintf(report, "DXYN: %llu draws, %llu sprite pixels (%.1f per draw), %llu lit (%.1f per draw)\n",
+				(long long unsigned)profile->draws, (long long unsigned)profile->draw_pixels,
+				(double)profile->draw_pixels / profile->draws, (long long unsigned)profile->draw_lit,
+				(double)profile->draw_lit / profile->draws);
+
+	fprintf(report, "\n%14s %7s  Opcode\n", "Count", "%");
+	for(uint32_t c = 0; c < class_count && counts[c].count; c++)
+		fprintf(report, "%14llu %6.2f%%  %s\n", (long long unsigned)counts[c].count,
+				counts[c].count * percent, classes[counts[c].key].name);
+
+	fprintf(report, "\n%14s %7s  Address  Opcode\n", "Count", "%");
+	for(uint32_t p = 0; p < pc_count && p < hot_pcs; p++)
+		fprintf(report, "%14llu %6.2f%%  0x%04X   %02X%02X\n", (long long unsigned)pcs[p].count,
+				pcs[p].count * percent, pcs[p].key, read_ram(chip8, pcs[p].key), read_ram(chip8, pcs[p].key + 1));
+	fputc('\n', report);
+
+	free(pcs);
+
+	for(uint32_t node = 0; node < profile->node_count; node++){
+		if(!profile->nodes[node].count) continue;
+
+		uint16_t path[PROFILE_MAX_NODES];
+		uint32_t depth = 0;
+		for(uint32_t n = node; n; n = profile->nodes[n].parent)
+			path[depth++] = profile->nodes[n].address;
+
+		fputs(chip8->rom_name, folded);
+		while(depth) fprintf(folded, ";sub_%04X", path[--depth]);
+		fprintf(folded, " %llu\n", (long long unsigned)profile->nodes[node].count);
+	}
+
+	return !ferror(report) && !ferror(folded);
+}
+
+bool save_profile_file(const chip8_t *chip8, const char *path){
+	//The report goes to path and the folded stacks next to it, to path.folded
+	char folded_path[1024];
+	snprintf(folded_path, sizeof folded_path, "%s.folded", path);
+
+	FILE *report = fopen(path,"w");
+	FILE *folded = fopen(folded_path,"w");
+	bool ok = report && folded && write_profile(chip8, report, folded);
+
+	if(report && fclose(report) != 0) ok = false;
+	if(folded && fclose(folded) != 0) ok = false;
+
+	if(!ok) SDL_Log("Could not write profile %s\n",path);
+	else SDL_Log("Wrote profile %s and %s\n",path,folded_path);
+	return ok;
+}
+
+//Handlers that depend on a quirk or on the extension are written once as a body taking that as a constant
+//and generated three ways: op_NAME tests the config every time it runs, op_NAME_on and op_NAME_off have
+//the answer folded in. decode_instruction() caches the folded ones, so running code never tests either
+#define QUIRK_INLINE static inline __attribute__((always_inline))
+
+#define SPECIALIZED_HANDLERS(name, condition) \
+	void op_##name(chip8_t *chip8, const instruction_t *inst, const config_t *config){ \
+		op_##name##_body(chip8, inst, config, condition); \
+	} \
+	void op_##name##_on(chip8_t *chip8, const instruction_t *inst, const config_t *config){ \
+		op_##name##_body(chip8, inst, config, true); \
+	} \
+	void op_##name##_off(chip8_t *chip8, const instruction_t *inst, const config_t *config){ \
+		op_##name##_body(chip8, inst, config, false); \
+	}
+
+#define QUIRK_HANDLERS(name, quirk_flag) SPECIALIZED_HANDLERS(name, config->quirks & (quirk_flag))
+#define XOCHIP_HANDLERS(name) SPECIALIZED_HANDLERS(name, config->current_extension == XOCHIP)
+
+#ifdef QUIRK_BRANCHES
+#define SPECIALIZED_HANDLER(name, condition) op_##name
+#else
+#define SPECIALIZED_HANDLER(name, condition) ((condition) ? op_##name##_on : op_##name##_off)
+#endif
+
+#define QUIRK_HANDLER(name, quirk_flag) SPECIALIZED_HANDLER(name, config->quirks & (quirk_flag))
+#define XOCHIP_HANDLER(name) SPECIALIZED_HANDLER(name, xo)
+
+QUIRK_INLINE void skip_instruction(chip8_t *chip8, const bool xo){
+	//XO-CHIP skips the 4 byte F000 NNNN as a single instruction
+	if(xo && read_ram(chip8, chip8->PC) == 0xF0 && read_ram(chip8, chip8->PC + 1) == 0x00)
+		chip8->PC += 4;
+	else
+		chip8->PC += 2;
+}
+
+void op_invalid(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	(void)chip8;
+	(void)inst;
+	(void)config;
+}
+
+void op_00E0(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00E0 : Clear the screen, only the selected planes on XO-CHIP
+	(void)inst;
+	(void)config;
+	for(uint8_t plane = 0; plane < 2; plane++){
+		if((chip8->planes >> plane) & 1)
+			memset(&chip8->display[plane],0,sizeof chip8->display[plane]);
+	}
+	chip8->dirty_rows = ~0ull;
+	chip8->events |= STOP_DRAW;
+}
+
+void op_00EE(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00EE : Return from subroutine
+	(void)inst;
+	(void)config;
+	chip8->PC = *--chip8->stack_ptr;
+}
+
+void op_00CN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00CN : Scroll the selected planes down N rows (SCHIP). Whole rows move, so it's one memmove per plane
+	(void)config;
+	const uint8_t height = chip8->hires ? 64 : 32;
+
+	for(uint8_t plane = 0; plane < 2; plane++){
+		if(!((chip8->planes >> plane) & 1)) continue;
+		uint64_t (*display)[2] = chip8->display[plane];
+
+		memmove(&display[inst->N], &display[0], (height - inst->N) * sizeof display[0]);
+		memset(&display[0], 0, inst->N * sizeof display[0]);
+	}
+	chip8->dirty_rows = ~0ull;
+	chip8->events |= STOP_DRAW;
+}
+
+void op_00DN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00DN : Scroll the selected planes up N rows (XO-CHIP)
+	(void)config;
+	const uint8_t height = chip8->hires ? 64 : 32;
+
+	for(uint8_t plane = 0; plane < 2; plane++){
+		if(!((chip8->planes >> plane) & 1)) continue;
+		uint64_t (*display)[2] = chip8->display[plane];
+
+		memmove(&display[0], &display[inst->N], (height - inst->N) * sizeof display[0]);
+		memset(&display[height - inst->N], 0, inst->N * sizeof display[0]);
+	}
+	chip8->dirty_rows = ~0ull;
+	chip8->events |= STOP_DRAW;
+}
+
+void op_00FB(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00FB : Scroll the selected planes right 4 pixels (SCHIP). In lores the second word is off screen and stays clear
+	(void)inst;
+	(void)config;
+	const uint8_t height = chip8->hires ? 64 : 32;
+	const uint64_t visible = chip8->hires ? ~0ull : 0;
+
+	for(uint8_t plane = 0; plane < 2; plane++){
+		if(!((chip8->planes >> plane) & 1)) continue;
+
+		for(uint8_t y = 0; y < height; y++){
+			uint64_t *row = chip8->display[plane][y];
+			row[1] = ((row[1] >> 4) | (row[0] << 60)) & visible;
+			row[0] >>= 4;
+		}
+	}
+	chip8->dirty_rows = ~0ull;
+	chip8->events |= STOP_DRAW;
+}
+
+void op_00FC(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00FC : Scroll the selected planes left 4 pixels (SCHIP)
+	(void)inst;
+	(void)config;
+	const uint8_t height = chip8->hires ? 64 : 32;
+
+	for(uint8_t plane = 0; plane < 2; plane++){
+		if(!((chip8->planes >> plane) & 1)) continue;
+
+		for(uint8_t y = 0; y < height; y++){
+			uint64_t *row = chip8->display[plane][y];
+			row[0] = (row[0] << 4) | (row[1] >> 60);
+			row[1] <<= 4;
+		}
+	}
+	chip8->dirty_rows = ~0ull;
+	chip8->events |= STOP_DRAW;
+}
+
+void op_00FD(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00FD : Exit the interpreter (SCHIP). The machine halts here, the window stays up for rewind or reset
+	(void)inst;
+	(void)config;
+	chip8->PC -= 2;
+	chip8->events |= STOP_HALT;
+}
+
+void set_resolution(chip8_t *chip8, const bool hires){
+	//Switching between 64x32 and 128x64 also clears the display, every plane of it
+	chip8->hires = hires;
+	memset(&chip8->display[0],0,sizeof chip8->display);
+	chip8->dirty_rows = ~0ull;
+	chip8->events |= STOP_DRAW;
+}
+
+void op_00FE(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00FE : Switch to 64x32 lores (SCHIP)
+	(void)inst;
+	(void)config;
+	set_resolution(chip8, false);
+}
+
+void op_00FF(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x00FF : Switch to 128x64 hires (SCHIP)
+	(void)inst;
+	(void)config;
+	set_resolution(chip8, true);
+}
+
+void op_1NNN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x1NNN : Jump to address NNN
+	(void)config;
+	chip8->PC = inst->NNN;
+}
+
+void op_2NNN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x2NNN : Call subroutine at NNN
+	(void)config;
+	*chip8->stack_ptr++ = chip8->PC;
+	chip8->PC = inst->NNN;
+}
+
+QUIRK_INLINE void op_3XNN_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool xo){
+	(void)config;
+	//0x3XNN : if(VX == NN) skip next instruction
+	if(chip8->V[inst->X] == inst->NN)
+		skip_instruction(chip8, xo);
+}
+
+XOCHIP_HANDLERS(3XNN)
+
+QUIRK_INLINE void op_4XNN_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool xo){
+	(void)config;
+	//0x4XNN : if(VX != NN) skip next instruction
+	if(chip8->V[inst->X] != inst->NN)
+		skip_instruction(chip8, xo);
+}
+
+XOCHIP_HANDLERS(4XNN)
+
+QUIRK_INLINE void op_5XY0_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool xo){
+	(void)config;
+	//0x5XY0 : if(VX == VY) skip next instruction
+	if(chip8->V[inst->X] == chip8->V[inst->Y])
+		skip_instruction(chip8, xo);
+}
+
+XOCHIP_HANDLERS(5XY0)
+
+void op_5XY2(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x5XY2 : Store VX - VY inclusive at I, in either order, I unchanged (XO-CHIP)
+	(void)config;
+	const int8_t step = inst->X <= inst->Y ? 1 : -1;
+
+	for(uint8_t i = 0, reg = inst->X; ; i++, reg += step){
+		write_ram(chip8, chip8->I + i, chip8->V[reg]);
+		if(reg == inst->Y) break;
+	}
+}
+
+void op_5XY3(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x5XY3 : Load VX - VY inclusive from I, in either order, I unchanged (XO-CHIP)
+	(void)config;
+	const int8_t step = inst->X <= inst->Y ? 1 : -1;
+
+	for(uint8_t i = 0, reg = inst->X; ; i++, reg += step){
+		chip8->V[reg] = read_ram(chip8, chip8->I + i);
+		if(reg == inst->Y) break;
+	}
+}
+
+void op_6XNN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x6xNN : Set register VX to NN
+	(void)config;
+	chip8->V[inst->X] = inst->NN;
+}
+
+void op_7XNN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x7xNN : Set register VX += NN
+	(void)config;
+	chip8->V[inst->X] += inst->NN;
+}
+
+void op_8XY0(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x8XY0 : Set register VX to VY
+	(void)config;
+	chip8->V[inst->X] = chip8->V[inst->Y];
+}
+
+QUIRK_INLINE void op_8XY1_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0x8XY1 : Set register VX |= VY
+	(void)config;
+	chip8->V[inst->X] |= chip8->V[inst->Y];
+	if(quirk){
+		chip8->V[0xF] = 0;
+	}
+}
+
+QUIRK_HANDLERS(8XY1, QUIRK_VF_RESET)
+
+QUIRK_INLINE void op_8XY2_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0x8XY2 : Set register VX &= VY
+	(void)config;
+	chip8->V[inst->X] &= chip8->V[inst->Y];
+	if(quirk){
+		chip8->V[0xF] = 0;
+	}
+}
+
+QUIRK_HANDLERS(8XY2, QUIRK_VF_RESET)
+
+QUIRK_INLINE void op_8XY3_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0x8XY3 : Set register VX ^= VY
+	(void)config;
+	chip8->V[inst->X] ^= chip8->V[inst->Y];
+	if(quirk){
+		chip8->V[0xF] = 0;
+	}
+}
+
+QUIRK_HANDLERS(8XY3, QUIRK_VF_RESET)
+
+void op_8XY4(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x8XY4 : Set register VX += VY and VF = 1 if carry
+	(void)config;
+	const bool carry = ((uint16_t)(chip8->V[inst->X] + chip8->V[inst->Y]) > 255);
+
+	chip8->V[inst->X] += chip8->V[inst->Y];
+	chip8->V[0xF] = carry;
+}
+
+void op_8XY5(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x8XY5 : Set register VX -= VY and VF = 1 if no borrow
+	(void)config;
+	const bool carry = chip8->V[inst->X] >= chip8->V[inst->Y];
+
+	chip8->V[inst->X] -= chip8->V[inst->Y];
+	chip8->V[0xF] = carry;
+}
+
+QUIRK_INLINE void op_8XY6_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0x8XY6 : Set register VX >>= 1, store shifted bit in VF. The shift quirk shifts VX in place
+	(void)config;
+	bool carry;
+	if(!quirk){
+		carry = chip8->V[inst->Y] & 1;
+		chip8->V[inst->X] = chip8->V[inst->Y] >> 1; 
+	}
+	else{
+		carry = chip8->V[inst->X] & 1;
+		chip8->V[inst->X] >>= 1;
+	}
+
+	chip8->V[0xF] = carry;
+}
+
+QUIRK_HANDLERS(8XY6, QUIRK_SHIFT)
+
+void op_8XY7(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0x8XY7 : Set register VX = VY - VX and VF = 1 if no borrow
+	(void)config;
+	const bool carry = chip8->V[inst->X] <= chip8->V[inst->Y];
+
+	chip8->V[inst->X] = chip8->V[inst->Y] - chip8->V[inst->X];
+	chip8->V[0xF] = carry;
+}
+
+QUIRK_INLINE void op_8XYE_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0x8XYE : Set register VX <<= 1, store shifted bit in VF. The shift quirk shifts VX in place
+	(void)config;
+	bool carry;
+	if(!quirk){
+		carry = (chip8->V[inst->Y] & 0x80) >> 7;
+		chip8->V[inst->X] = chip8->V[inst->Y] << 1; 
+	}
+	else{
+		carry = (chip8->V[inst->X] & 0x80) >> 7;
+		chip8->V[inst->X] <<= 1;
+	}
+
+	chip8->V[0xF] = carry;
+}
+
+QUIRK_HANDLERS(8XYE, QUIRK_SHIFT)
+
+QUIRK_INLINE void op_9XY0_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool xo){
+	(void)config;
+	//0x9XY0 : if VX != VY skip the next instruction
+	if(chip8->V[inst->X] != chip8->V[inst->Y])
+		skip_instruction(chip8, xo);
+}
+
+XOCHIP_HANDLERS(9XY0)
+
+void op_ANNN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xANNN : Set index register I to NNN
+	(void)config;
+	chip8->I = inst->NNN;
+}
+
+QUIRK_INLINE void op_BNNN_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0xBNNN : Jump to V0 + NNN. The jump quirk reads it as BXNN and jumps to VX + XNN
+	(void)config;
+	if(quirk)
+		chip8->PC = chip8->V[inst->X] + inst->NNN;
+	else
+		chip8->PC = chip8->V[0] + inst->NNN;
+}
+
+QUIRK_HANDLERS(BNNN, QUIRK_JUMP)
+
+uint8_t random_byte(chip8_t *chip8){
+	//xorshift32, kept per instance so instances running side by side don't share one rand() state
+	uint32_t x = chip8->rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	chip8->rng_state = x;
+	return x >> 24;
+}
+
+void op_CXNN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xCXNN : Setx VX = random byte & NN
+	(void)config;
+	chip8->V[inst->X] = random_byte(chip8) & inst->NN;
+}
+
+//How DXYN draws, decided by the clip quirk and the extension and folded into its handlers the same way
+enum{
+	DRAW_CLIP = 1 << 0,			//QUIRK_CLIP
+	DRAW_BIG = 1 << 1,			//N = 0 draws a 16x16 sprite (SCHIP, XO-CHIP)
+	DRAW_COUNT_ROWS = 1 << 2,	//VF counts collided and clipped rows in hires (SCHIP)
+};
+
+uint8_t draw_variant(const instruction_t *inst, const config_t *config){
+	return (config->quirks & QUIRK_CLIP ? DRAW_CLIP : 0) |
+		   (inst->N == 0 && config->current_extension != CHIP8 ? DRAW_BIG : 0) |
+		   (config->current_extension == SUPERCHIP ? DRAW_COUNT_ROWS : 0);
+}
+
+QUIRK_INLINE void op_DXYN_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const uint8_t variant){
+	//0xDXYN : Draw N-height sprite at coords X,Y; Read from I	
+	//Rows are pairs of 64-bit words with x = 0 in the MSB of the first, so a sprite row is a shift, AND and
+	//XOR per word. Bits shifted past the right edge fall off, which clips like the per-pixel loop did.
+	//SCHIP draws a 16x16 sprite of 2 byte rows for N = 0. XO-CHIP draws to every selected plane, each
+	//with its own sprite data following the last, and wraps sprites around the edges instead of clipping
+	const uint8_t width = chip8->hires ? 128 : 64;
+	const uint8_t height = chip8->hires ? 64 : 32;
+	(void)config;
+	const bool big = variant & DRAW_BIG;
+	const bool wrap = !(variant & DRAW_CLIP);
+	const uint8_t sprite_height = big ? 16 : inst->N;
+	const uint8_t sprite_width = big ? 16 : 8;
+	const uint8_t X_coord = chip8->V[inst->X] % width;
+	const uint8_t Y_coord = chip8->V[inst->Y] % height;
+	uint8_t rows = sprite_height;
+	uint8_t collided_rows = 0;
+	uint16_t address = chip8->I;
+
+	if(Y_coord + rows > height && !wrap) rows = height - Y_coord;
+
+	for(uint8_t plane = 0; plane < 2; plane++){
+		if(!((chip8->planes >> plane) & 1)) continue;
+
+		for(uint8_t i = 0; i < rows; i++){
+			const uint8_t y = (Y_coord + i) % height;
+			const uint16_t row_address = address + (big ? i*2 : i);
+			uint64_t sprite_row = (uint64_t)read_ram(chip8, row_address) << 56;
+			if(big) sprite_row |= (uint64_t)read_ram(chip8, row_address + 1) << 48;
+
+			//In lores the second word is off screen, so anything past x = 63 is dropped
+			uint64_t left = X_coord < 64 ? sprite_row >> X_coord : 0;
+			const uint64_t right = width == 64 || X_coord == 0 ? 0 :
+								   X_coord < 64 ? sprite_row << (64 - X_coord) : sprite_row >> (X_coord - 64);
+
+			//What fell off the right edge comes back in at x = 0
+			if(wrap && X_coord + sprite_width > width)
+				left |= sprite_row << (width - X_coord);
+
+			uint64_t *row = chip8->display[plane][y];
+
+			collided_rows += ((row[0] & left) | (row[1] & right)) != 0;
+			row[0] ^= left;
+			row[1] ^= right;
+			chip8->dirty_rows |= (uint64_t)(sprite_row != 0) << y;
+		}
+
+		address += big ? 32 : sprite_height;
+	}
+
+	chip8->events |= STOP_DRAW;
+
+	//SCHIP hires counts the rows that collided or were clipped off the bottom
+	if(chip8->hires && (variant & DRAW_COUNT_ROWS))
+		chip8->V[0xF] = collided_rows + (sprite_height - rows);
+	else
+		chip8->V[0xF] = collided_rows != 0;
+}
+
+void op_DXYN(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	op_DXYN_body(chip8, inst, config, draw_variant(inst, config));
+}
+
+#define DXYN_HANDLER(variant) \
+	void op_DXYN_##variant(chip8_t *chip8, const instruction_t *inst, const config_t *config){ \
+		op_DXYN_body(chip8, inst, config, variant); \
+	}
+
+DXYN_HANDLER(0) DXYN_HANDLER(1) DXYN_HANDLER(2) DXYN_HANDLER(3)
+DXYN_HANDLER(4) DXYN_HANDLER(5) DXYN_HANDLER(6) DXYN_HANDLER(7)
+
+const inst_handler_t op_DXYN_variants[] = {
+	op_DXYN_0, op_DXYN_1, op_DXYN_2, op_DXYN_3, op_DXYN_4, op_DXYN_5, op_DXYN_6, op_DXYN_7,
+};
+
+#ifdef QUIRK_BRANCHES
+#define DXYN_VARIANT(inst, config) op_DXYN
+#else
+#define DXYN_VARIANT(inst, config) op_DXYN_variants[draw_variant(inst, config)]
+#endif
+
+QUIRK_INLINE void op_EX9E_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool xo){
+	(void)config;
+	//0xEX9E : Skip next instruction if key in VX is pressed. Only the low nibble names a key, as on the VIP
+	if(chip8->keypad[chip8->V[inst->X] & 0xF])
+		skip_instruction(chip8, xo);
+}
+
+XOCHIP_HANDLERS(EX9E)
+
+QUIRK_INLINE void op_EXA1_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool xo){
+	(void)config;
+	//0xEXA1 : Skip next instruction if key in VX is not pressed 
+	if(!chip8->keypad[chip8->V[inst->X] & 0xF])
+		skip_instruction(chip8, xo);
+}
+
+XOCHIP_HANDLERS(EXA1)
+
+void op_FX0A(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX0A : VX = get_key(); Await until a keypress, and store in VX
+	(void)config;
+	for(uint8_t i = 0; chip8->key == 0xFF && i < sizeof chip8->keypad; i++){
+		if(chip8->keypad[i]){
+			chip8->key = i;
+			chip8->any_key_pressed = true;
+			break;
+		}
+	}
+	if(!chip8->any_key_pressed){
+		chip8->PC -= 2;
+		chip8->events |= STOP_KEY_WAIT;
+	}
+	else{
+		if(chip8->keypad[chip8->key]){
+			chip8->PC -= 2;
+			chip8->events |= STOP_KEY_WAIT;
+		}
+		else{
+			chip8->V[inst->X] = chip8->key;
+			chip8->key = 0xFF;
+			chip8->any_key_pressed = false;
+		}
+	}
+}
+
+void op_F000(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xF000 NNNN : I = NNNN, the 16-bit address in the next word (XO-CHIP)
+	(void)inst;
+	(void)config;
+	chip8->I = (read_ram(chip8, chip8->PC) << 8) | read_ram(chip8, chip8->PC + 1);
+	chip8->PC += 2;
+}
+
+void op_FN01(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFN01 : Select the planes N (bitmask) that draws, clears and scrolls affect (XO-CHIP)
+	(void)config;
+	chip8->planes = inst->X & 3;
+}
+
+void op_FX02(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xF002 : Load the 16 byte audio pattern from I (XO-CHIP)
+	(void)inst;
+	(void)config;
+	for(uint8_t i = 0; i < sizeof chip8->audio_pattern; i++)
+		chip8->audio_pattern[i] = read_ram(chip8, chip8->I + i);
+	chip8->pattern_loaded = true;
+}
+
+void op_FX3A(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX3A : Pitch register = VX (XO-CHIP)
+	(void)config;
+	chip8->pitch = chip8->V[inst->X];
+}
+
+void op_FX1E(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX1E : I += VX
+	(void)config;
+	chip8->I += chip8->V[inst->X];
+}
+
+void op_FX07(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX07 : VX = delay timer
+	(void)config;
+	chip8->V[inst->X] = chip8->delay_timer;
+	chip8->events |= (chip8->delay_timer != 0) * STOP_TIMER_WAIT;
+}
+
+void op_FX15(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX15 : delay timer = VX
+	(void)config;
+	chip8->delay_timer = chip8->V[inst->X];
+}
+
+void op_FX18(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX18 : sound timer = VX
+	(void)config;
+	chip8->sound_timer = chip8->V[inst->X];
+}
+
+void op_FX29(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX29 : I = sprite location in VX
+	(void)config;
+	chip8->I = chip8->V[inst->X] * 5;
+}
+
+void op_FX30(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX30 : I = big (8x10) sprite location in VX (SCHIP)
+	(void)config;
+	chip8->I = BIG_FONT_ADDRESS + (chip8->V[inst->X] & 0xF) * 10;
+}
+
+void op_FX33(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX33 : Store BCD representation of VX at memory offset from I
+	(void)config;
+	uint8_t BCD = chip8->V[inst->X];
+	write_ram(chip8, chip8->I + 2, BCD % 10);
+	BCD /= 10; 
+	write_ram(chip8, chip8->I + 1, BCD % 10);
+	BCD /= 10; 
+	write_ram(chip8, chip8->I, BCD);
+}
+
+QUIRK_INLINE void op_FX55_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0xFX55 : Register dumpp V0 - VX inclusive to memory offset from I. The load/store quirk leaves I alone
+	(void)config;
+	for(uint8_t i = 0; i <= inst->X; i++){
+		if(!quirk) 
+			write_ram(chip8, chip8->I++, chip8->V[i]);
+		else
+			write_ram(chip8, chip8->I + i, chip8->V[i]);
+	}	
+}
+
+QUIRK_HANDLERS(FX55, QUIRK_LOAD_STORE)
+
+QUIRK_INLINE void op_FX65_body(chip8_t *chip8, const instruction_t *inst, const config_t *config, const bool quirk){
+	//0xFX65 : Register load V0 - VX inclusive from memory offset from I. The load/store quirk leaves I alone
+	(void)config;
+	for(uint8_t i = 0; i <= inst->X; i++){
+		if(!quirk) 
+			chip8->V[i] = read_ram(chip8, chip8->I++);
+		else
+			chip8->V[i] = read_ram(chip8, chip8->I + i);
+	}
+}
+
+QUIRK_HANDLERS(FX65, QUIRK_LOAD_STORE)
+
+void op_FX75(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX75 : Save V0 - VX inclusive to the RPL user flags (SCHIP)
+	(void)config;
+	memcpy(chip8->rpl, chip8->V, inst->X + 1);
+}
+
+void op_FX85(chip8_t *chip8, const instruction_t *inst, const config_t *config){
+	//0xFX85 : Load V0 - VX inclusive from the RPL user flags (SCHIP)
+	(void)config;
+	memcpy(chip8->V, chip8->rpl, inst->X + 1);
+}
+
+void decode_instruction(decoded_t *decoded, const uint16_t opcode, const config_t *config){
+	//Split the opcode into its operands and pick the handler once, so cached instructions skip this.
+	//Handlers are picked for this extension and these quirks, so the cache is only valid for one config
+	instruction_t *inst = &decoded->inst;
+
+	inst->opcode = opcode;
+	inst->NNN = opcode & 0x0FFF;	
+	inst->NN = opcode & 0x0FF;	
+	inst->N = opcode & 0x0F;	
+	inst->X = (opcode >> 8) & 0x0F;	
+	inst->Y = (opcode >> 4) & 0x0F;
+
+	inst_handler_t handler = op_invalid;
+	const bool schip = config->current_extension != CHIP8;
+	const bool xo = config->current_extension == XOCHIP;
+
+	switch((opcode >> 12) & 0x0F){
+		case 0x00 :
+			if(inst->NN == 0xE0) handler = op_00E0;
+			else if(inst->NN == 0xEE) handler = op_00EE;
+			else if(schip && inst->X == 0){
+				if(inst->Y == 0xC) handler = op_00CN;
+				else if(inst->Y == 0xD && xo) handler = op_00DN;
+				else if(inst->NN == 0xFB) handler = op_00FB;
+				else if(inst->NN == 0xFC) handler = op_00FC;
+				else if(inst->NN == 0xFD) handler = op_00FD;
+				else if(inst->NN == 0xFE) handler = op_00FE;
+				else if(inst->NN == 0xFF) handler = op_00FF;
+			}
+			break;
+
+		case 0x01 : handler = op_1NNN; break;
+		case 0x02 : handler = op_2NNN; break;
+		case 0x03 : handler = XOCHIP_HANDLER(3XNN); break;
+		case 0x04 : handler = XOCHIP_HANDLER(4XNN); break;
+		case 0x05 :
+			if(inst->N == 0) handler = XOCHIP_HANDLER(5XY0);
+			else if(inst->N == 2 && xo) handler = op_5XY2;
+			else if(inst->N == 3 && xo) handler = op_5XY3;
+			break;
+
+		case 0x06 : handler = op_6XNN; break;
+		case 0x07 : handler = op_7XNN; break;
+
+		case 0x08 :
+			switch(inst->N){
+				case 0 : handler = op_8XY0; break;
+				case 1 : handler = QUIRK_HANDLER(8XY1, QUIRK_VF_RESET); break;
+				case 2 : handler = QUIRK_HANDLER(8XY2, QUIRK_VF_RESET); break;
+				case 3 : handler = QUIRK_HANDLER(8XY3, QUIRK_VF_RESET); break;
+				case 4 : handler = op_8XY4; break;
+				case 5 : handler = op_8XY5; break;
+				case 6 : handler = QUIRK_HANDLER(8XY6, QUIRK_SHIFT); break;
+				case 7 : handler = op_8XY7; break;
+				case 0xE : handler = QUIRK_HANDLER(8XYE, QUIRK_SHIFT); break;
+				default : break;
+			}
+			break;
+
+		case 0x09 : handler = XOCHIP_HANDLER(9XY0); break;
+		case 0x0A : handler = op_ANNN; break;
+		case 0x0B : handler = QUIRK_HANDLER(BNNN, QUIRK_JUMP); break;
+		case 0x0C : handler = op_CXNN; break;
+		case 0x0D : handler = DXYN_VARIANT(inst, config); break;
+
+		case 0x0E :
+			if(inst->NN == 0x9E) handler = XOCHIP_HANDLER(EX9E);
+			else if(inst->NN == 0xA1) handler = XOCHIP_HANDLER(EXA1);
+			break;
+
+		case 0x0F :
+			switch(inst->NN){
+				case 0x00 : if(xo && inst->X == 0) handler = op_F000; break;
+				case 0x01 : if(xo) handler = op_FN01; break;
+				case 0x02 : if(xo && inst->X == 0) handler = op_FX02; break;
+				case 0x3A : if(xo) handler = op_FX3A; break;
+				case 0x0A : handler = op_FX0A; break;
+				case 0x1E : handler = op_FX1E; break;
+				case 0x07 : handler = op_FX07; break;
+				case 0x15 : handler = op_FX15; break;
+				case 0x18 : handler = op_FX18; break;
+				case 0x29 : handler = op_FX29; break;
+				case 0x30 : if(schip) handler = op_FX30; break;
+				case 0x33 : handler = op_FX33; break;
+				case 0x55 : handler = QUIRK_HANDLER(FX55, QUIRK_LOAD_STORE); break;
+				case 0x65 : handler = QUIRK_HANDLER(FX65, QUIRK_LOAD_STORE); break;
+				case 0x75 : if(schip) handler = op_FX75; break;
+				case 0x85 : if(schip) handler = op_FX85; break;
+				default : break;
+			}
+			break;
+
+		default :
+			break;
+	}
+
+	decoded->handler = handler;
+}
+
+bool debugger_armed(const debugger_t *debugger){
+	return debugger->breakpoint_count || debugger->watchpoint_count || debugger->condition_count ||
+		   debugger->mode != DEBUG_RUN;
+}
+
+void debugger_break_in(debugger_t *debugger, chip8_t *chip8){
+	//Stop before the next instruction, for --debug and F4
+	debugger->mode = DEBUG_STEP;
+	debugger->steps = 1;
+	chip8->debugger = debugger;
+}
+
+bool check_condition(const chip8_t *chip8, const debug_condition_t *condition){
+	const uint16_t regs[3] = {chip8->I, chip8->delay_timer, chip8->sound_timer};
+	const uint16_t value = condition->reg < 16 ? chip8->V[condition->reg] : regs[condition->reg - 16];
+
+	switch(condition->op){
+		case 0 : return value == condition->value;
+		case 1 : return value != condition->value;
+		case 2 : return value < condition->value;
+		case 3 : return value > condition->value;
+		case 4 : return value <= condition->value;
+		default : return value >= condition->value;
+	}
+}
+
+void disassemble(const chip8_t *chip8, const config_t *config, const debugger_t *debugger,
+				 uint16_t address, const uint32_t count){
+	//The print_instruction() descriptions, read with the current registers, from address on
+	for(uint32_t i = 0; i < count; i++){
+		const uint16_t opcode = (read_ram(chip8, address) << 8) | read_ram(chip8, address + 1);
+		decoded_t decoded;
+		decode_instruction(&decoded, opcode, config);
+
+		printf("%s%c ", address == chip8->PC ? "=>" : "  ",
+			   (debugger->breakpoints[address >> 3] >> (address & 7)) & 1 ? '*' : ' ');
+		print_instruction(stdout, chip8, address, &decoded.inst);
+
+		address += config->current_extension == XOCHIP && opcode == 0xF000 ? 4 : 2;
+	}
+}
+
+uint32_t set_address_bits(uint8_t *bits, const uint16_t address, const uint32_t length, const bool on){
+	//Returns how many bits changed
+	uint32_t changed = 0;
+
+	for(uint32_t a = address; a < address + length && a < 0x10000; a++){
+		const uint8_t bit = 1 << (a & 7);
+		changed += ((bits[a >> 3] & bit) != 0) != on;
+		bits[a >> 3] = on ? bits[a >> 3] | bit : bits[a >> 3] & ~bit;
+	}
+	return changed;
+}
+
+void detach_debugger(debugger_t *debugger){
+	//Forget every breakpoint and stop, but keep listening for the GUI's quit
+	*debugger = (debugger_t){.commands = debugger->commands};
+}
+
+bool read_prompt_line(char *line, const size_t size, SDL_atomic_t *commands){
+	//Headless runs block in fgets(). The GUI's prompt runs on the emulation thread, so it reads stdin a
+	//byte at a time as it arrives and gives up when the window asks to quit. Bytes go straight through
+	//read() there, stdio buffering could hold a line poll() never sees
+	if(!commands) return fgets(line, size, stdin) != NULL;
+
+	size_t len = 0;
+	while(len + 1 < size){
+		if(SDL_AtomicGet(commands) & COMMAND_QUIT) return false;
+
+		struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+		if(poll(&in, 1, 100) <= 0) continue;
+
+		char c;
+		if(read(STDIN_FILENO, &c, 1) != 1){
+			if(!len) return false;
+			break;
+		}
+		line[len++] = c;
+		if(c == '\n') break;
+	}
+	line[len] = '\0';
+	return true;
+}
+
+void debugger_prompt(debugger_t *debugger, chip8_t *chip8, const config_t *config){
+	//Read commands from stdin until one resumes execution. Addresses are hex, other values take 0x
+	const char *registers[] = {"V0","V1","V2","V3","V4","V5","V6","V7","V8","V9","VA","VB","VC","VD","VE","VF",
+							   "I","DT","ST"};
+	const char *comparisons[] = {"==","!=","<",">","<=",">="};
+	const char *delimiters = " \t\r\n";
+	const uint8_t depth = chip8->stack_ptr - chip8->stack;
+	char line[256];
+
+	disassemble(chip8, config, debugger, chip8->PC, 1);
+
+	while(true){
+		printf("(chip8) ");
+		fflush(stdout);
+
+		if(!read_prompt_line(line, sizeof line, debugger->commands)){
+			//No more input or the window is closing, let the ROM run on without the debugger
+			detach_debugger(debugger);
+			return;
+		}
+
+		char *cursor = line;
+		const char *command = next_token(&cursor, delimiters);
+		const char *arg1 = next_token(&cursor, delimiters);
+		const char *arg2 = next_token(&cursor, delimiters);
+		const char *arg3 = next_token(&cursor, delimiters);
+
+		if(!command) continue;
+
+		if(strcmp(command,"c") == 0 || strcmp(command,"continue") == 0){
+			return;
+		}
+		else if(strcmp(command,"s") == 0 || strcmp(command,"step") == 0){
+			debugger->mode = DEBUG_STEP;
+			debugger->steps = arg1 && strtoul(arg1,NULL,0) ? strtoul(arg1,NULL,0) : 1;
+			return;
+		}
+		else if(strcmp(command,"n") == 0 || strcmp(command,"next") == 0){
+			//Over a 2NNN the stack only gets back to this depth once the subroutine returned
+			debugger->mode = DEBUG_OVER;
+			debugger->depth = depth;
+			return;
+		}
+		else if(strcmp(command,"f") == 0 || strcmp(command,"finish") == 0){
+			if(!depth){
+				printf("Not in a subroutine\n");
+				continue;
+			}
+			debugger->mode = DEBUG_OUT;
+			debugger->depth = depth;
+			return;
+		}
+		else if(strcmp(command,"b") == 0 || strcmp(command,"break") == 0){
+			if(arg1){
+				debugger->breakpoint_count += set_address_bits(debugger->breakpoints, strtoul(arg1,NULL,16), 1, true);
+				continue;
+			}
+			for(uint32_t a = 0; a < 0x10000; a++){
+				if((debugger->breakpoints[a >> 3] >> (a & 7)) & 1) printf("Breakpoint 0x%04X\n", a);
+			}
+		}
+		else if(strcmp(command,"d") == 0 || strcmp(command,"delete") == 0){
+			if(arg1) debugger->breakpoint_count -= set_address_bits(debugger->breakpoints, strtoul(arg1,NULL,16), 1, false);
+		}
+		else if(strcmp(command,"w") == 0 || strcmp(command,"watch") == 0){
+			if(arg1){
+				debugger->watchpoint_count += set_address_bits(debugger->watchpoints, strtoul(arg1,NULL,16),
+															  arg2 ? strtoul(arg2,NULL,0) : 1, true);
+				continue;
+			}
+			for(uint32_t a = 0; a < 0x10000; a++){
+				if((debugger->watchpoints[a >> 3] >> (a & 7)) & 1) printf("Watchpoint 0x%04X\n", a);
+			}
+		}
+		else if(strcmp(command,"dw") == 0){
+			if(arg1) debugger->watchpoint_count -= set_address_bits(debugger->watchpoints, strtoul(arg1,NULL,16),
+																   arg2 ? strtoul(arg2,NULL,0) : 1, false);
+		}
+		else if(strcmp(command,"cond") == 0){
+			if(!arg1){
+				for(uint8_t c = 0; c < debugger->condition_count; c++)
+					printf("%u: %s %s 0x%X\n", c, registers[debugger->conditions[c].reg],
+						   comparisons[debugger->conditions[c].op], debugger->conditions[c].value);
+				continue;
+			}
+
+			debug_condition_t condition = {.reg = 0xFF, .op = 0xFF};
+			for(uint8_t reg = 0; reg < sizeof registers / sizeof registers[0]; reg++){
+				if(SDL_strcasecmp(arg1, registers[reg]) == 0) condition.reg = reg;
+			}
+			for(uint8_t op = 0; arg2 && op < sizeof comparisons / sizeof comparisons[0]; op++){
+				if(strcmp(arg2, comparisons[op]) == 0) condition.op = op;
+			}
+
+			if(condition.reg == 0xFF || condition.op == 0xFF || !arg3 ||
+			   debugger->condition_count == sizeof debugger->conditions / sizeof debugger->conditions[0]){
+				printf("Usage: cond V0-VF|I|DT|ST ==|!=|<|>|<=|>= value, at most 16\n");
+				continue;
+			}
+
+			condition.value = strtoul(arg3,NULL,0);
+			condition.held = check_condition(chip8, &condition);
+			debugger->conditions[debugger->condition_count++] = condition;
+		}
+		else if(strcmp(command,"dc") == 0){
+			const uint32_t c = arg1 ? strtoul(arg1,NULL,0) : debugger->condition_count;
+			if(c >= debugger->condition_count) continue;
+
+			memmove(&debugger->conditions[c], &debugger->conditions[c + 1],
+					(debugger->condition_count - c - 1) * sizeof debugger->conditions[0]);
+			debugger->condition_count--;
+		}
+		else if(strcmp(command,"r") == 0 || strcmp(command,"regs") == 0){
+			for(uint8_t reg = 0; reg < 16; reg++)
+				printf("V%X=%02X%c", reg, chip8->V[reg], reg == 7 || reg == 15 ? '\n' : ' ');
+			printf("I=%04X PC=%04X DT=%02X ST=%02X SP=%u\n", chip8->I, chip8->PC,
+				   chip8->delay_timer, chip8->sound_timer, depth);
+		}
+		else if(strcmp(command,"bt") == 0){
+			//Each entry is where a 2NNN will return to
+			printf("#0 0x%04X\n", chip8->PC);
+			for(uint8_t level = depth; level > 0; level--)
+				printf("#%u 0x%04X\n", depth - level + 1, chip8->stack[level - 1]);
+		}
+		else if(strcmp(command,"x") == 0){
+			const uint16_t address = arg1 ? strtoul(arg1,NULL,16) : chip8->I;
+			const uint32_t length = arg2 ? strtoul(arg2,NULL,0) : 16;
+
+			for(uint32_t i = 0; i < length; i++)
+				printf("%s%02X", i % 16 ? " " : i ? "\n" : "", read_ram(chip8, address + i));
+			printf("\n");
+		}
+		else if(strcmp(command,"l") == 0 || strcmp(command,"list") == 0){
+			disassemble(chip8, config, debugger, arg1 ? strtoul(arg1,NULL,16) : chip8->PC,
+						arg2 ? strtoul(arg2,NULL,0) : 10);
+		}
+		else if(strcmp(command,"q") == 0 || strcmp(command,"detach") == 0){
+			detach_debugger(debugger);
+			return;
+		}
+		else{
+			printf("c(ontinue), s(tep) [N], n(ext), f(inish), b(reak) [addr], d(elete) addr,\n"
+				   "w(atch) [addr [len]], dw addr [len], cond [reg op value], dc N, r(egs), bt,\n"
+				   "x [addr [len]], l(ist) [addr [N]], q/detach\n");
+		}
+	}
+}
+
+bool debug_instruction(debugger_t *debugger, chip8_t *chip8, const config_t *config){
+	//Runs before every instruction while a debugger is attached, and stops in the prompt when
+	//something set in it is hit. A remote debugger halts instead: returns false and the instruction
+	//isn't run until it resumes
+	const uint16_t PC = chip8->PC;
+	const uint8_t depth = chip8->stack_ptr - chip8->stack;
+	const bool quiet = debugger->remote;
+	bool stop = false;
+
+	if(debugger->resuming){
+		debugger->resuming = false;
+		debugger->last_PC = PC;
+		return true;
+	}
+
+	debugger->stopped_by_watch = debugger->watch_hit;
+	if(debugger->watch_hit){
+		if(!quiet)
+			printf("Watchpoint 0x%04X written by 0x%04X: 0x%02X -> 0x%02X\n", debugger->watch_address,
+				   debugger->watch_PC, debugger->watch_old, debugger->watch_new);
+		debugger->watch_hit = false;
+		stop = true;
+	}
+
+	if((debugger->breakpoints[PC >> 3] >> (PC & 7)) & 1){
+		if(!quiet) printf("Breakpoint 0x%04X\n", PC);
+		stop = true;
+	}
+
+	for(uint8_t c = 0; c < debugger->condition_count; c++){
+		debug_condition_t *condition = &debugger->conditions[c];
+		const bool held = check_condition(chip8, condition);
+
+		if(held && !condition->held){
+			if(!quiet) printf("Condition %u turned true\n", c);
+			stop = true;
+		}
+		condition->held = held;
+	}
+
+	switch(debugger->mode){
+		case DEBUG_STEP : stop |= --debugger->steps == 0; break;
+		case DEBUG_OVER : stop |= depth <= debugger->depth; break;
+		case DEBUG_OUT : stop |= depth < debugger->depth; break;
+		default : break;
+	}
+
+	if(stop && debugger->remote){
+		debugger->mode = DEBUG_RUN;
+		debugger->halted = true;
+		chip8->events |= STOP_BREAK;
+		return false;
+	}
+
+	if(stop){
+		debugger->mode = DEBUG_RUN;
+		debugger_prompt(debugger, chip8, config);
+		if(!debugger_armed(debugger)) chip8->debugger = NULL;
+	}
+
+	debugger->last_PC = chip8->PC;
+	return true;
+}
+
+void emulate_instruction(chip8_t *chip8,const config_t *config){
+
+	if(chip8->debugger && !debug_instruction(chip8->debugger, chip8, config)) return;
+
+	const uint16_t PC = chip8->PC & (chip8->ram_size - 1);
+	decoded_t *decoded = &chip8->decoded[PC >> 1];
+	decoded_t uncached;
+
+	if((PC & 1) || PC >= sizeof chip8->ram_4k){
+		//Instructions at odd addresses straddle two cache slots and XO-CHIP code past 4KB has none,
+		//decode them every time
+		decoded = &uncached;
+		decode_instruction(decoded, (read_ram(chip8, PC)<<8) | read_ram(chip8, PC+1), config);
+	}
+	else if(!decoded->handler){
+		decode_instruction(decoded, (chip8->ram[PC]<<8) | chip8->ram[PC+1], config);
+	}
+
+	chip8->PC += 2;
+
+	decoded->handler(chip8, &decoded->inst, config);
+
+	if(chip8->trace) trace_instruction(chip8->trace, chip8->trace->count++, chip8, PC, &decoded->inst);
+	if(chip8->profile) profile_instruction(chip8->profile, chip8, config, PC, &decoded->inst);
+}
+
+bool ends_block(const uint16_t opcode){
+	//Anything that can change PC ends a block, and so does a RAM store since it may rewrite the block
+	switch((opcode >> 12) & 0x0F){
+		case 0x00 : return opcode == 0x00EE || opcode == 0x00FD;
+		case 0x01 :
+		case 0x02 :
+		case 0x03 :
+		case 0x04 :
+		case 0x05 :
+		case 0x09 :
+		case 0x0B :
+		case 0x0E : return true;
+		case 0x0F : return opcode == 0xF000 || (opcode & 0xFF) == 0x0A || (opcode & 0xFF) == 0x33 || (opcode & 0xFF) == 0x55;
+		default : return false;
+	}
+}
+
+uint8_t build_block(chip8_t *chip8, const config_t *config, const uint16_t start_slot){
+	const uint8_t max_block_len = 64;
+	uint8_t len = 0;
+
+	for(uint16_t slot = start_slot; slot < sizeof chip8->block_len && len < max_block_len; slot++){
+		decoded_t *decoded = &chip8->decoded[slot];
+
+		if(!decoded->handler)
+			decode_instruction(decoded, (chip8->ram[slot*2]<<8) | chip8->ram[slot*2+1], config);
+
+		chip8->code_slot[slot] = true;
+		len++;
+
+		if(ends_block(decoded->inst.opcode)) break;
+	}
+
+	chip8->block_len[start_slot] = len;
+	return len;
+}
+
+stop_reason_t emulate_cycles(chip8_t *chip8, const config_t *config, const uint32_t max_insts,
+							 const uint32_t stop_on, uint32_t *executed){
+	//Run up to max_insts instructions as chains of cached blocks, stopping early after the block in which
+	//one of the stop_on events happened. PC is loaded once per block and stored once for its handlers,
+	//instead of once per instruction. Returns the event that stopped it, or STOP_BUDGET; *executed gets the count
+	uint32_t done = 0;
+
+	chip8->events = 0;
+
+	while(done < max_insts){
+		const uint16_t PC = chip8->PC;
+
+		//A debugger goes one instruction at a time, so it can stop before any of them
+		if(!(PC & 1) && PC <= 0xFFF && !chip8->debugger){
+			const uint16_t start_slot = PC >> 1;
+			uint32_t len = chip8->block_len[start_slot];
+			if(!len) len = build_block(chip8, config, start_slot);
+			if(len > max_insts - done) len = max_insts - done;
+
+			const decoded_t *decoded = &chip8->decoded[start_slot];
+
+			//Only the last instruction of a block reads PC, so it's written once up front
+			chip8->PC = PC + len*2;
+
+			if(chip8->trace && !chip8->profile){
+				//Tracing alone gets its own loop, with no per-instruction test for the profiler
+				trace_t *trace = chip8->trace;
+				const uint32_t count = trace->count;
+
+				for(uint32_t i = 0; i < len; i++){
+					decoded[i].handler(chip8, &decoded[i].inst, config);
+					trace_instruction(trace, count + i, chip8, PC + i*2, &decoded[i].inst);
+				}
+				trace->count = count + len;
+			}
+			else if(chip8->profile){
+				trace_t *trace = chip8->trace;
+				profile_t *profile = chip8->profile;
+				const uint32_t count = trace ? trace->count : 0;
+
+				for(uint32_t i = 0; i < len; i++){
+					decoded[i].handler(chip8, &decoded[i].inst, config);
+					if(trace) trace_instruction(trace, count + i, chip8, PC + i*2, &decoded[i].inst);
+					if(profile) profile_instruction(profile, chip8, config, PC + i*2, &decoded[i].inst);
+				}
+				if(trace) trace->count = count + len;
+			}
+			else{
+				for(uint32_t i = 0; i < len; i++)
+					decoded[i].handler(chip8, &decoded[i].inst, config);
+			}
+
+			done += len;
+		}
+		else{
+			emulate_instruction(chip8,config);
+			done += !(chip8->events & STOP_BREAK);
+		}
+
+		if(chip8->events & (stop_on | STOP_BREAK)) break;
+	}
+
+	*executed = done;
+
+	//Report the first reason in stop_reason_t order when several happened in the same block
+	const uint32_t stopped = chip8->events & (stop_on | STOP_BREAK);
+	return stopped ? (stop_reason_t)(stopped & -stopped) : STOP_BUDGET;
+}
+
+void update_timer(chip8_t *chip8){
+	if(chip8->delay_timer > 0)
+		chip8->delay_timer--;
+
+	if(chip8->sound_timer > 0)
+		chip8->sound_timer--;
+}
+
+uint32_t hash_state(const chip8_t *chip8){
+	//FNV-1a over the machine state, used to check that benchmark runs are repeatable
+	//Pixels of the current resolution are hashed one byte each so the hash doesn't depend on how the display is packed
+	const uint32_t width = chip8->hires ? 128 : 64;
+	const uint32_t height = chip8->hires ? 64 : 32;
+	uint32_t hash = fnv1a(2166136261u, chip8->ram, chip8->ram_size);
+
+	for(size_t i = 0; i < width*height; i++){
+		const uint32_t x = i % width;
+		const uint8_t pixel = ((chip8->display[0][i/width][x/64] >> (63 - x%64)) & 1) |
+							  (((chip8->display[1][i/width][x/64] >> (63 - x%64)) & 1) << 1);
+		hash = fnv1a(hash, &pixel, 1);
+	}
+
+	hash = fnv1a(hash, chip8->V, sizeof chip8->V);
+
+	return hash ^ chip8->PC ^ ((uint32_t)chip8->I << 16);
+}
+
+uint32_t timer_wait_loop(const chip8_t *chip8){
+	//Recognise the delay timer poll FX07, 3XNN or 4XNN, 1NNN back to the FX07, sitting at the jump the way
+	//emulate_cycles() leaves it after the block with the FX07. Returns the loop's length in instructions
+	//if it keeps looping at the current timer value, or 0
+	const uint16_t jump = chip8->PC;
+	const uint16_t start = jump - 4;
+	if(jump < 4 || start > 0xFFF) return 0;
+
+	const uint16_t load = (read_ram(chip8, start) << 8) | read_ram(chip8, start + 1);
+	const uint16_t test = (read_ram(chip8, start + 2) << 8) | read_ram(chip8, start + 3);
+	const uint16_t back = (read_ram(chip8, jump) << 8) | read_ram(chip8, jump + 1);
+	const uint8_t X = (load >> 8) & 0x0F;
+
+	if((load & 0xF0FF) != 0xF007 || back != (0x1000 | start)) return 0;
+	if((test >> 12 != 3 && test >> 12 != 4) || ((test >> 8) & 0x0F) != X) return 0;
+
+	//3XNN leaves the loop once the timer reaches NN, 4XNN once it moves off NN
+	const bool leaves = (test >> 12 == 3) == (chip8->delay_timer == (test & 0xFF));
+	return leaves ? 0 : 3;
+}
+
+uint32_t emulate_tick(chip8_t *chip8, const config_t *config){
+	//Run the instructions owed for one 60Hz timer period. The remainder of inst_per_sec/60 is carried
+	//over, so 500 inst/s runs 8, 8, 9, 8, 8, 9... instead of truncating to 480. Returns instructions run.
+	//Waits are skipped rather than run, with the same result: FX0A waiting for a key repeats the same
+	//state until the keypad changes between ticks, and each lap of a delay timer poll loop ends where it
+	//started until the timer changes between ticks. Only the odd instructions of a partial lap are run,
+	//the rest are counted in skipped and not returned.
+	//A remote debugger halting mid tick leaves the rest in tick_left, and the next call finishes it
+	const uint32_t owed = chip8->cycle_fraction + config->inst_per_sec;
+	const uint32_t inst_per_frame = chip8->tick_left ? chip8->tick_left : owed / 60;
+
+	uint32_t ran = 0;
+
+	if(!chip8->tick_left) chip8->cycle_fraction = owed % 60;
+	chip8->tick_left = 0;
+	chip8->waiting_for_key = false;
+
+	for(uint32_t done = 0; done < inst_per_frame;){
+		uint32_t executed;
+		const stop_reason_t reason = emulate_cycles(chip8,config,inst_per_frame - done,
+													STOP_KEY_WAIT | STOP_TIMER_WAIT,&executed);
+		done += executed;
+		ran += executed;
+
+		if(chip8->events & STOP_BREAK){
+			chip8->tick_left = inst_per_frame - done;
+			chip8->skipped += done - ran;
+			return ran;
+		}
+
+		if(reason == STOP_KEY_WAIT){
+			chip8->waiting_for_key = true;
+			break;
+		}
+
+		const uint32_t loop = reason == STOP_TIMER_WAIT ? timer_wait_loop(chip8) : 0;
+		if(loop) done += (inst_per_frame - done) / loop * loop;
+	}
+
+	if(chip8->profile) profile_frame(chip8->profile, ran);
+
+	chip8->skipped += inst_per_frame - ran;
+	return ran;
+}
+
+uint32_t emulate_frame(chip8_t *chip8, const config_t *config, wav_t *wav){
+	//One 60Hz frame with no host attached: a tick's worth of instructions and a timer tick, plus the
+	//tick's sound when wav is given. A tick cut short by a remote debugger is finished by the next call
+	const uint32_t insts = emulate_tick(chip8,config);
+	if(chip8->tick_left) return insts;
+
+	if(wav){
+		int16_t samples[2048];
+		const uint32_t count = synth_tick(&wav->synth, chip8, 1, samples, sizeof samples / sizeof *samples);
 
-	uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
-	uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
-	uint8_t bg_b = (config.bg_color >> 8) & 0xFF;
-	uint8_t bg_a = (config.bg_color >> 0) & 0xFF;
+		for(uint32_t i = 0; i < count; i++)
+			fput_le(wav->file, (uint16_t)samples[i], 2);
+		wav->samples += count;
+	}
 
-	for(uint32_t i = 0; i < sizeof chip8->display; i++){
+	chip8->dirty_rows = 0;
+	update_timer(chip8);
+	return insts;
+}
 
-		rect.x = (i%config.window_width) * config.scale_factor;
-		rect.y = (i/config.window_width) * config.scale_factor;
+bool open_gdb_stub(gdb_stub_t *gdb, const uint16_t port, debugger_t *debugger){
+	//Listen on localhost only, the protocol has no authentication and can rewrite the whole machine.
+	//Like gdbserver, the machine is held before its first instruction until a debugger resumes it
+	*gdb = (gdb_stub_t){.listener = -1, .client = -1, .debugger = debugger, .stop_signal = 5};
+	if(!port) return true;
+
+	const struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port),
+										.sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	const int reuse = 1;
+
+	gdb->listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(gdb->listener < 0 || setsockopt(gdb->listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse) != 0 ||
+	   bind(gdb->listener, (const struct sockaddr *)&address, sizeof address) != 0 ||
+	   listen(gdb->listener, 1) != 0 || fcntl(gdb->listener, F_SETFL, O_NONBLOCK) != 0){
+		SDL_Log("Could not listen for gdb on port %u: %s\n", port, strerror(errno));
+		if(gdb->listener >= 0) close(gdb->listener);
+		gdb->listener = -1;
+		return false;
+	}
 
-		if(chip8->display[i]){
+	//A debugger that goes away mid reply shows up as a failed send, not a signal
+	signal(SIGPIPE, SIG_IGN);
 
-			if(chip8->pixel_color != &config.fg_color){
-				chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], 
-                                                   config.fg_color, 
-                                                   config.color_lerp_rate);
-			}
+	debugger->remote = true;
+	debugger->halted = true;
+	SDL_Log("Waiting for gdb on 127.0.0.1:%u\n", port);
+	return true;
+}
 
-			uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-			uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-			uint8_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
-			uint8_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
+void gdb_send(gdb_stub_t *gdb, const char *payload){
+	//$payload#checksum. Replies are small, so the rare full socket is just waited on
+	char packet[GDB_PACKET_SIZE + 8];
+	uint8_t checksum = 0;
 
-			SDL_SetRenderDrawColor(sdl.renderer,r,g,b,a);
-			SDL_RenderFillRect(sdl.renderer,&rect);
+	for(const char *c = payload; *c; c++) checksum += *c;
+	const int length = snprintf(packet, sizeof packet, "$%s#%02x", payload, checksum);
 
-			if(config.pixel_outlines){
-				SDL_SetRenderDrawColor(sdl.renderer,bg_r,bg_g,bg_b,bg_a);
-				SDL_RenderDrawRect(sdl.renderer,&rect);
-			}
+	for(int sent = 0; sent < length;){
+		const ssize_t n = send(gdb->client, packet + sent, length - sent, 0);
+
+		if(n > 0){
+			sent += n;
+		}
+		else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			struct pollfd fd = {.fd = gdb->client, .events = POLLOUT};
+			poll(&fd, 1, 100);
 		}
 		else{
-			if (chip8->pixel_color[i] != config.bg_color) {
-                chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], 
-                                                   config.bg_color, 
-                                                   config.color_lerp_rate);
-            }
+			//The next read sees the connection closed and detaches
+			shutdown(gdb->client, SHUT_RDWR);
+			return;
+		}
+	}
+}
 
-            const uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const uint8_t b = (chip8->pixel_color[i] >>  8) & 0xFF;
-            const uint8_t a = (chip8->pixel_color[i] >>  0) & 0xFF;
+void close_gdb_stub(gdb_stub_t *gdb){
+	//A debugger still waiting on a c or s hears that the program exited
+	if(gdb->client >= 0 && gdb->waiting) gdb_send(gdb, "W00");
+	if(gdb->client >= 0) close(gdb->client);
+	if(gdb->listener >= 0) close(gdb->listener);
+	gdb->client = gdb->listener = -1;
+}
 
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
-		}
-	}	
+void gdb_stop_reply(gdb_stub_t *gdb){
+	char reply[32];
+	const debugger_t *debugger = gdb->debugger;
 
-	SDL_RenderPresent(sdl.renderer);
+	if(debugger->stopped_by_watch)
+		snprintf(reply, sizeof reply, "T%02xwatch:%04x;", gdb->stop_signal, debugger->watch_address);
+	else
+		snprintf(reply, sizeof reply, "S%02x", gdb->stop_signal);
+	gdb_send(gdb, reply);
 }
 
-void handle_input(chip8_t *chip8, config_t *config){
-	SDL_Event event;
-	
-	while(SDL_PollEvent(&event)){
-		switch(event.type){
-			case SDL_QUIT : 
-				chip8->state = QUIT;
-				return;
+#define GDB_REGISTERS 33	//V0-VF, I, PC, SP (the stack depth), DT, ST, then the 12 stack entries
 
-			case SDL_KEYDOWN : 
-				switch(event.key.keysym.sym){
-					case SDLK_SPACE:
-						if(chip8->state == RUNNING){
-							chip8->state = PAUSED;
-							puts("====PAUSED====");
-						} else {
-							chip8->state = RUNNING;
-						}
-						break;
-					
-					case SDLK_EQUALS : 
-						init_chip8(chip8,*config,chip8->rom_name);
-						break;
+uint16_t gdb_register(const chip8_t *chip8, const uint32_t n, uint8_t *size){
+	*size = n < 16 || (n >= 18 && n <= 20) ? 1 : 2;
 
-					case SDLK_1 : chip8->keypad[0x1] = true; break;
-					case SDLK_2 : chip8->keypad[0x2] = true; break;
-					case SDLK_3 : chip8->keypad[0x3] = true; break;
-					case SDLK_4 : chip8->keypad[0xC] = true; break;
-
-					case SDLK_q : chip8->keypad[0x4] = true; break;
-					case SDLK_w : chip8->keypad[0x5] = true; break;
-					case SDLK_e : chip8->keypad[0x6] = true; break;
-					case SDLK_r : chip8->keypad[0xD] = true; break;
-					
-					case SDLK_a : chip8->keypad[0x7] = true; break;
-					case SDLK_s : chip8->keypad[0x8] = true; break;
-					case SDLK_d : chip8->keypad[0x9] = true; break;
-					case SDLK_f : chip8->keypad[0xE] = true; break;
-
-					case SDLK_z : chip8->keypad[0xA] = true; break;
-					case SDLK_x : chip8->keypad[0x0] = true; break;
-					case SDLK_c : chip8->keypad[0xB] = true; break;
-					case SDLK_v : chip8->keypad[0xF] = true; break;
-					default : break;
-				}
-				break;
+	if(n < 16) return chip8->V[n];
+	switch(n){
+		case 16 : return chip8->I;
+		case 17 : return chip8->PC;
+		case 18 : return chip8->stack_ptr - chip8->stack;
+		case 19 : return chip8->delay_timer;
+		case 20 : return chip8->sound_timer;
+		default : return chip8->stack[n - 21];
+	}
+}
 
-			case SDL_KEYUP :
-				switch(event.key.keysym.sym){
-					case SDLK_1 : chip8->keypad[0x1] = false; break;
-					case SDLK_2 : chip8->keypad[0x2] = false; break;
-					case SDLK_3 : chip8->keypad[0x3] = false; break;
-					case SDLK_4 : chip8->keypad[0xC] = false; break;
-
-					case SDLK_q : chip8->keypad[0x4] = false; break;
-					case SDLK_w : chip8->keypad[0x5] = false; break;
-					case SDLK_e : chip8->keypad[0x6] = false; break;
-					case SDLK_r : chip8->keypad[0xD] = false; break;
-					
-					case SDLK_a : chip8->keypad[0x7] = false; break;
-					case SDLK_s : chip8->keypad[0x8] = false; break;
-					case SDLK_d : chip8->keypad[0x9] = false; break;
-					case SDLK_f : chip8->keypad[0xE] = false; break;
-
-					case SDLK_z : chip8->keypad[0xA] = false; break;
-					case SDLK_x : chip8->keypad[0x0] = false; break;
-					case SDLK_c : chip8->keypad[0xB] = false; break;
-					case SDLK_v : chip8->keypad[0xF] = false; break;
-					default : break;
-				}
-				break;
+void gdb_set_register(chip8_t *chip8, const uint32_t n, const uint16_t value){
+	if(n < 16){
+		chip8->V[n] = value;
+		return;
+	}
+	switch(n){
+		case 16 : chip8->I = value; break;
+		case 17 : chip8->PC = value; break;
+		case 18 : chip8->stack_ptr = chip8->stack + (value < 12 ? value : 12); break;
+		case 19 : chip8->delay_timer = value; break;
+		case 20 : chip8->sound_timer = value; break;
+		default : chip8->stack[n - 21] = value; break;
+	}
+}
 
-			default : 
-				break;
-		}
+char *gdb_put_register(char *out, const chip8_t *chip8, const uint32_t n){
+	//Target byte order, little endian
+	uint8_t size;
+	const uint16_t value = gdb_register(chip8, n, &size);
+
+	for(uint8_t b = 0; b < size; b++)
+		out += sprintf(out, "%02x", (value >> (b * 8)) & 0xFF);
+	return out;
+}
+
+const char *gdb_get_register(const char *in, chip8_t *chip8, const uint32_t n){
+	uint8_t size;
+	uint16_t value = 0;
+	gdb_register(chip8, n, &size);
+
+	for(uint8_t b = 0; b < size && in[0] && in[1]; b++, in += 2){
+		const char byte[3] = {in[0], in[1], '\0'};
+		value |= strtoul(byte, NULL, 16) << (b * 8);
 	}
+	gdb_set_register(chip8, n, value);
+	return in;
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8){
-	printf("Address: 0x%04X, Opcode: 0x%04X Desc: ",
-		  chip8->PC-2,chip8->inst.opcode);
+void gdb_target_xml(char *xml, const size_t size){
+	//Stock gdb has no CHIP-8 architecture, this describes the register layout of g and p to it
+	const char *names[] = {"i", "pc", "sp", "dt", "st"};
+	int length = snprintf(xml, size, "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+									 "<target><feature name=\"org.chip8.core\">");
 
-	switch((chip8->inst.opcode>>12) & 0x0F){
-		case 0x00 :
-			if(chip8->inst.NN == 0xE0){
-				//0x00E0 : Clear the screen
-				printf("Clear the screen\n");
-			}
-			else if(chip8->inst.NN == 0xEE){
-				//0x00EE : Return from subroutine
-				printf("Return from subroutine to address 0x%04X\n",
-						*(chip8->stack_ptr - 1));
-			}
-			else
-				printf("unimplemented\n");
+	for(uint32_t n = 0; n < GDB_REGISTERS; n++){
+		char name[8];
+		if(n < 16) snprintf(name, sizeof name, "v%x", n);
+		else if(n < 21) snprintf(name, sizeof name, "%s", names[n - 16]);
+		else snprintf(name, sizeof name, "stack%u", n - 21);
+
+		length += snprintf(xml + length, size - length, "<reg name=\"%s\" bitsize=\"%u\" type=\"%s\"/>", name,
+						   n < 16 || (n >= 18 && n <= 20) ? 8 : 16, n == 17 ? "code_ptr" : n == 16 ? "data_ptr" : "int");
+	}
+	snprintf(xml + length, size - length, "</feature></target>");
+}
+
+void gdb_resume(gdb_stub_t *gdb, chip8_t *chip8, const bool step){
+	//The instruction it halted before runs unchecked, so a breakpoint there doesn't stop it again
+	debugger_t *debugger = gdb->debugger;
+
+	debugger->mode = step ? DEBUG_STEP : DEBUG_RUN;
+	debugger->steps = 1;
+	debugger->halted = false;
+	debugger->resuming = true;
+	debugger->stopped_by_watch = false;
+	gdb->stop_signal = 5;
+	gdb->waiting = true;
+	chip8->debugger = debugger_armed(debugger) ? debugger : NULL;
+}
+
+bool gdb_packet(gdb_stub_t *gdb, chip8_t *chip8, char *packet){
+	//Answer one packet, returns false when the debugger detaches. Anything unsupported gets the empty reply
+	debugger_t *debugger = gdb->debugger;
+	static char reply[GDB_PACKET_SIZE];
+	char *out = reply;
+	char *end;
+	*out = '\0';
+
+	switch(packet[0]){
+		case '?' :
+			gdb_stop_reply(gdb);
+			return true;
+
+		case 'g' :
+			for(uint32_t n = 0; n < GDB_REGISTERS; n++)
+				out = gdb_put_register(out, chip8, n);
 			break;
-		
-		case 0x01:
-			//0x1NNN : Jump to address NNN
-			printf("Jump to address NNN (0x%04X)\n",chip8->inst.NNN);
+
+		case 'G' : {
+			const char *in = packet + 1;
+			for(uint32_t n = 0; n < GDB_REGISTERS; n++)
+				in = gdb_get_register(in, chip8, n);
+			strcpy(reply, "OK");
 			break;
+		}
 
-		case 0x02 :
-			//0x2NNN : Call subroutine at NNN
-			printf("Call subroutine at 0x%04X\n", chip8->inst.NNN);
+		case 'p' : {
+			const uint32_t n = strtoul(packet + 1, NULL, 16);
+			if(n < GDB_REGISTERS) gdb_put_register(out, chip8, n);
+			else strcpy(reply, "E01");
 			break;
+		}
 
-		case 0x03 : 
-			//0x3XNN : if(VX == NN) skip next instruction
-			printf("if V%X (0x%02X) == NN (0x%02X) skip next instruction ",
-					chip8->inst.X,chip8->V[chip8->inst.X],chip8->inst.NN);
+		case 'P' : {
+			const uint32_t n = strtoul(packet + 1, &end, 16);
+			if(*end == '=' && n < GDB_REGISTERS){
+				gdb_get_register(end + 1, chip8, n);
+				strcpy(reply, "OK");
+			}
+			else strcpy(reply, "E01");
 			break;
-		
-		case 0x04 : 
-			//0x4XNN : if(VX != NN) skip next instruction
-			printf("if V%X (0x%02X) != NN (0x%02X) skip next instruction ",
-					chip8->inst.X,chip8->V[chip8->inst.X],chip8->inst.NN);
+		}
+
+		case 'm' : {
+			//Reads wrap at the end of RAM like the core's own
+			const uint32_t address = strtoul(packet + 1, &end, 16);
+			uint32_t length = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+			if(length > (sizeof reply - 1) / 2) length = (sizeof reply - 1) / 2;
+
+			for(uint32_t i = 0; i < length; i++)
+				out += sprintf(out, "%02x", read_ram(chip8, address + i));
 			break;
-		
-		case 0x05 : 
-			//0x5XY0 : if(VX == VY) skip next instruction
-			printf("if V%X (0x%02X) == V%X (0x%02X) skip next instruction ",
-					chip8->inst.X,chip8->V[chip8->inst.X],chip8->inst.Y,chip8->V[chip8->inst.Y]);
+		}
+
+		case 'M' : {
+			//Through write_ram() so cached decodes and blocks over the bytes are dropped, without
+			//tripping the debugger's own watchpoints
+			const uint32_t address = strtoul(packet + 1, &end, 16);
+			const uint32_t length = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+			if(*end != ':'){
+				strcpy(reply, "E01");
+				break;
+			}
+
+			const char *in = end + 1;
+			chip8->debugger = NULL;
+			for(uint32_t i = 0; i < length && in[0] && in[1]; i++, in += 2){
+				const char byte[3] = {in[0], in[1], '\0'};
+				write_ram(chip8, address + i, strtoul(byte, NULL, 16));
+			}
+			chip8->debugger = debugger_armed(debugger) ? debugger : NULL;
+			strcpy(reply, "OK");
 			break;
+		}
 
-		case 0x06 :
-			//0x6xNN : Set register VX to NN
-			printf("Set register V%X to NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
+		case 'Z' :
+		case 'z' : {
+			//Z0/Z1 breakpoints and Z2 write watchpoints, all kept in the debugger's bitmaps
+			const bool on = packet[0] == 'Z';
+			const char type = packet[1];
+			const uint16_t address = strtoul(packet + 3, &end, 16);
+			const uint32_t length = *end == ',' ? strtoul(end + 1, NULL, 16) : 1;
+
+			if(type == '0' || type == '1'){
+				const uint32_t changed = set_address_bits(debugger->breakpoints, address, 1, on);
+				debugger->breakpoint_count += on ? changed : -changed;
+			}
+			else if(type == '2'){
+				const uint32_t changed = set_address_bits(debugger->watchpoints, address, length, on);
+				debugger->watchpoint_count += on ? changed : -changed;
+			}
+			else break;
+			strcpy(reply, "OK");
 			break;
+		}
 
-		case 0x07 :
-			//0x7xNN : Set register VX += NN
-			printf("Set register V%X (0x%02X) += NN (0x%02X). Result : 0x%02X\n",
-				    chip8->inst.X,chip8->V[chip8->inst.X], chip8->inst.NN,
-					chip8->V[chip8->inst.X] + chip8->inst.NN);
+		case 'c' :
+		case 's' :
+			//No reply until the machine halts again
+			if(packet[1]) chip8->PC = strtoul(packet + 1, NULL, 16);
+			gdb_resume(gdb, chip8, packet[0] == 's');
+			return true;
+
+		case 'D' :
+			gdb_send(gdb, "OK");
+			return false;
+
+		case 'k' :
+			return false;
+
+		case 'H' :
+			strcpy(reply, "OK");
 			break;
 
-		case 0x08 :
-			switch(chip8->inst.N){
-				case 0 :
-					//0x8XY0 : Set register VX to VY
-					printf("Set register V%X == V%X (0x%02X)\n",
-				    		chip8->inst.X,chip8->inst.Y,chip8->V[chip8->inst.Y]);
-					break;
+		case 'q' :
+			if(strncmp(packet, "qSupported", 10) == 0){
+				snprintf(reply, sizeof reply, "PacketSize=%x;qXfer:features:read+", GDB_PACKET_SIZE);
+			}
+			else if(strcmp(packet, "qAttached") == 0){
+				strcpy(reply, "1");
+			}
+			else if(strncmp(packet, "qXfer:features:read:target.xml:", 31) == 0){
+				char xml[GDB_PACKET_SIZE];
+				gdb_target_xml(xml, sizeof xml);
 
-				case 1 :
-					//0x8XY1 : Set register VX |= VY
-					printf("Set register V%X (0x%02X) |= V%X (0x%02X). Result : 0x%02X\n",
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->inst.Y,chip8->V[chip8->inst.Y],
-							chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
-					break;	
-				
-				case 2 :
-					//0x8XY2 : Set register VX &= VY
-					printf("Set register V%X (0x%02X) &= V%X (0x%02X). Result : 0x%02X\n",
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->inst.Y,chip8->V[chip8->inst.Y],
-							chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
-					break;
+				const uint32_t offset = strtoul(packet + 31, &end, 16);
+				uint32_t length = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+				const uint32_t size = strlen(xml);
+				if(length > sizeof reply - 2) length = sizeof reply - 2;
 
-				case 3 :
-					//0x8XY3 : Set register VX ^= VY
-					printf("Set register V%X (0x%02X) ^= V%X (0x%02X). Result : 0x%02X\n",
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->inst.Y,chip8->V[chip8->inst.Y],
-							chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
-					break;
+				if(offset >= size) strcpy(reply, "l");
+				else snprintf(reply, sizeof reply, "%c%.*s", offset + length >= size ? 'l' : 'm', length, xml + offset);
+			}
+			break;
 
-				case 4 :
-					//0x8XY4 : Set register VX += VY and VF = 1 if carry
-					printf("Set register V%X (0x%02X) += V%X (0x%02X). Result : 0x%02X, VF = %X\n",
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->inst.Y,chip8->V[chip8->inst.Y],
-							chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y],
-							((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255));
-					break;
-				
-				case 5 :
-					//0x8XY5 : Set register VX -= VY and VF = 1 if no borrow
-					printf("Set register V%X (0x%02X) -= V%X (0x%02X). Result : 0x%02X, VF = %X\n",
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->inst.Y,chip8->V[chip8->inst.Y],
-							chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y],
-							(chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]));
-					break;
+		default :
+			break;
+	}
 
-				case 6 :
-					//0x8XY6 : Set register VX >>= 1, store shifted bit in VF
-					printf("Set register V%X (0x%02X) >>= 1. Result : 0x%02X, VF = %X\n",
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->V[chip8->inst.X] >> 1,
-							chip8->V[chip8->inst.X] & 1);
-					break;
-				
-				case 7 :
-					//0x8XY7 : Set register VX = VY - VX and VF = 1 if no borrow
-					printf("Set register V%X = V%X (0x%02X) - V%X (0x%02X). Result : 0x%02X, VF = %X\n",
-							chip8->inst.X,
-							chip8->inst.Y,chip8->V[chip8->inst.Y],
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X],
-							(chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
-					break;
+	gdb_send(gdb, reply);
+	return true;
+}
 
-				case 0xE :
-					//0x8XYE : Set register VX <<= 1, store shifted bit in VF
-					printf("Set register V%X (0x%02X) <<= 1. Result : 0x%02X, VF = %X\n",
-							chip8->inst.X,chip8->V[chip8->inst.X],
-							chip8->V[chip8->inst.X] << 1,
-							(chip8->V[chip8->inst.X] & 0x80) >> 7);
-					break;
+void gdb_disconnect(gdb_stub_t *gdb, chip8_t *chip8){
+	//Whatever the debugger set goes with it, and the machine runs on
+	close(gdb->client);
+	gdb->client = -1;
+	gdb->in_len = 0;
+	gdb->waiting = false;
+	*gdb->debugger = (debugger_t){.remote = true};
+	chip8->debugger = NULL;
+	SDL_Log("gdb detached\n");
+}
 
-				default :
-					break;
+void gdb_poll(gdb_stub_t *gdb, chip8_t *chip8, const int timeout){
+	//Called between batches: takes a new connection, answers the packets that came in and sends the
+	//stop reply once a c or s halted again. Waits up to timeout ms for input, for callers that are
+	//halted anyway. Checksums aren't verified, TCP already is reliable
+	debugger_t *debugger = gdb->debugger;
+
+	if(gdb->client < 0){
+		struct pollfd fd = {.fd = gdb->listener, .events = POLLIN};
+		if(poll(&fd, 1, timeout) <= 0) return;
+
+		gdb->client = accept(gdb->listener, NULL, NULL);
+		if(gdb->client < 0) return;
+
+		const int nodelay = 1;
+		fcntl(gdb->client, F_SETFL, O_NONBLOCK);
+		setsockopt(gdb->client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+
+		//A new debugger finds the machine stopped, where it was if it was running
+		debugger->halted = true;
+		debugger->stopped_by_watch = false;
+		gdb->stop_signal = 5;
+		SDL_Log("gdb attached\n");
+		return;
+	}
+
+	//A stop reply that's due goes out without waiting
+	struct pollfd fd = {.fd = gdb->client, .events = POLLIN};
+	if(poll(&fd, 1, gdb->waiting && debugger->halted ? 0 : timeout) > 0){
+		const ssize_t received = recv(gdb->client, gdb->in + gdb->in_len, sizeof gdb->in - gdb->in_len, 0);
+
+		if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)){
+			gdb_disconnect(gdb, chip8);
+			return;
+		}
+		if(received > 0) gdb->in_len += received;
+	}
+
+	//Acks are dropped, 0x03 is Ctrl-C and $...#xx a packet. A partial packet waits for the rest
+	size_t start = 0;
+	while(start < gdb->in_len){
+		char *c = gdb->in + start;
+
+		if(*c == '$'){
+			char *end = memchr(c, '#', gdb->in_len - start);
+			if(!end || end + 3 > gdb->in + gdb->in_len) break;
+
+			*end = '\0';
+			start = end + 3 - gdb->in;
+			send(gdb->client, "+", 1, 0);
+
+			if(!gdb_packet(gdb, chip8, c + 1)){
+				gdb_disconnect(gdb, chip8);
+				return;
 			}
+			continue;
+		}
+
+		if(*c == 0x03 && !debugger->halted){
+			debugger->halted = true;
+			debugger->stopped_by_watch = false;
+			gdb->stop_signal = 2;
+		}
+		start++;
+	}
+
+	memmove(gdb->in, gdb->in + start, gdb->in_len - start);
+	gdb->in_len -= start;
+	if(gdb->in_len == sizeof gdb->in) gdb->in_len = 0;	//A packet too big to ever fit, dropped
+
+	if(gdb->waiting && debugger->halted){
+		gdb_stop_reply(gdb);
+		gdb->waiting = false;
+	}
+}
+
+void publish_frame(frontend_t *frontend, const uint32_t input_seq){
+	//Core: hand the display to the presenter and wake the main thread, unless a wakeup is already queued
+	frame_buffer_t *frames = &frontend->frames;
+	frame_t *frame = &frames->frames[frames->back];
+
+	memcpy(frame->display, frontend->chip8.display, sizeof frame->display);
+	frame->hires = frontend->chip8.hires;
+	frame->input_seq = input_seq;
+
+	//The frame is complete before the swap publishes it, and the one handed back is written only after
+	//the presenter let go of it
+	SDL_MemoryBarrierRelease();
+	frames->back = SDL_AtomicSet(&frames->middle, frames->back | FRAME_FRESH) & 3;
+	SDL_MemoryBarrierAcquire();
+
+	if(SDL_AtomicCAS(&frontend->frame_event_pending, 0, 1)){
+		SDL_Event event = {.type = frontend->frame_event};
+		SDL_PushEvent(&event);
+	}
+}
+
+void run_commands(frontend_t *frontend, const uint32_t commands){
+	//Core: the one-shot commands the main thread queued since the last look
+	chip8_t *chip8 = &frontend->chip8;
+	save_slot_t *save_slot = &frontend->save_slot;
+
+	if(commands & COMMAND_PAUSE){
+		if(chip8->state == RUNNING){
+			chip8->state = PAUSED;
+			puts("====PAUSED====");
+		} else {
+			chip8->state = RUNNING;
+		}
+	}
+
+	if(commands & COMMAND_RESET){
+		//A trace or profile keeps going across the reset, so it shows how the machine got there
+		trace_t *trace = chip8->trace;
+		profile_t *profile = chip8->profile;
+		debugger_t *debugger = chip8->debugger;
+		uint8_t *old_ram = chip8->ram != chip8->ram_4k ? chip8->ram : NULL;
+
+		//init_chip8() fails before touching the machine, so a failed reset leaves it running as it was
+		if(init_chip8(chip8,frontend->config,chip8->rom_name)){
+			free(old_ram);
+			chip8->trace = trace;
+			chip8->profile = profile;
+			chip8->debugger = debugger;
+			if(profile) profile->current = 0;
+			stop_recording(frontend);
+		}
+		else SDL_Log("Reset failed, keeping the running machine\n");
+	}
+
+	if(commands & COMMAND_SAVE){
+		//F5 : Snapshot into the in-memory slot and <rom>.state
+		char path[1024];
+		snprintf(path, sizeof path, "%s.state", chip8->rom_name);
+		const uint64_t start = SDL_GetPerformanceCounter();
+		save_slot->size = save_state(chip8, save_slot->data, sizeof save_slot->data);
+		const uint64_t end = SDL_GetPerformanceCounter();
+		save_state_file(chip8, path);
+		SDL_Log("Saved state in %.2f us\n", (end - start) * 1e6 / SDL_GetPerformanceFrequency());
+	}
+
+	if(commands & COMMAND_LOAD){
+		//F9 : Restore the in-memory slot, or <rom>.state if nothing was saved this session
+		stop_recording(frontend);
+		if(save_slot->size){
+			load_state(chip8, &frontend->config, save_slot->data, save_slot->size);
+		}
+		else{
+			char path[1024];
+			snprintf(path, sizeof path, "%s.state", chip8->rom_name);
+			load_state_file(chip8, &frontend->config, path);
+		}
+	}
+
+	if(commands & COMMAND_TRACE){
+		//F2 : Start tracing, or stop and write the trace to --trace or <rom>.trace
+		if(chip8->trace){
+			char path[1024];
+			snprintf(path, sizeof path, "%s.trace", chip8->rom_name);
+			save_trace_file(chip8, frontend->config.trace_file ? frontend->config.trace_file : path);
+			stop_trace(chip8);
+		}
+		else if(start_trace(chip8)){
+			SDL_Log("Tracing started\n");
+		}
+	}
+
+	if(commands & COMMAND_PROFILE){
+		//F3 : Start profiling, or stop and write the profile to --profile or <rom>.profile
+		if(chip8->profile){
+			char path[1024];
+			snprintf(path, sizeof path, "%s.profile", chip8->rom_name);
+			save_profile_file(chip8, frontend->config.profile_file ? frontend->config.profile_file : path);
+			stop_profile(chip8);
+		}
+		else if(start_profile(chip8)){
+			SDL_Log("Profiling started\n");
+		}
+	}
+
+	if(commands & COMMAND_BREAK){
+		//F4 : Stop in the debugger before the next instruction, the prompt is on the console
+		debugger_break_in(&frontend->debugger, chip8);
+	}
+}
+
+int emulation_thread(void *data){
+	//Emulated time is counted in 60Hz ticks, each one a timer tick plus the instructions owed for it.
+	//Every tick has a deadline on the performance counter, one period after the last. Nothing here waits
+	//on the display: frames are published and the main thread presents them whenever vsync lets it
+	frontend_t *frontend = data;
+	chip8_t *chip8 = &frontend->chip8;
+	const config_t *config = &frontend->config;
+	const double freq = SDL_GetPerformanceFrequency();
+	const uint64_t sleep_margin = freq / 1000;	//The semaphore only waits to the millisecond, nanosleep() does the rest
+	const uint64_t max_late_ticks = 8;			//Give up on catching up after a long stall instead of spinning
+	uint64_t next_tick = SDL_GetPerformanceCounter();
+	uint32_t ticked_seq = SDL_AtomicGet(&frontend->input_seq);
+
+	publish_frame(frontend, ticked_seq);
+
+	while(true){
+		const uint32_t commands = SDL_AtomicSet(&frontend->commands, 0);
+		if(commands & COMMAND_QUIT){
+			//A trace or profile still running is written out as if F2 or F3 stopped it
+			run_commands(frontend, (chip8->trace ? COMMAND_TRACE : 0) | (chip8->profile ? COMMAND_PROFILE : 0));
 			break;
+		}
+		run_commands(frontend, commands);
+		if(frontend->gdb.listener >= 0) gdb_poll(&frontend->gdb, chip8, 0);
+
+		const uint32_t input_seq = SDL_AtomicGet(&frontend->input_seq);
+		const bool rewinding = SDL_AtomicGet(&frontend->rewinding);
+		set_keypad_mask(chip8, SDL_AtomicGet(&frontend->keys));
+
+		//Paused, halted by gdb, or parked on FX0A with both timers stopped and no key changed since: nothing
+		//can change until the main thread or gdb sends something, so sleep until it does. No time passes for
+		//the machine meanwhile, and gdb is polled every 10ms
+		const bool idle = chip8->state == PAUSED || frontend->debugger.halted ||
+						  (chip8->waiting_for_key && !chip8->delay_timer && !chip8->sound_timer &&
+						   input_seq == ticked_seq && !rewinding);
+		if(idle){
+			if(chip8->dirty_rows){
+				publish_frame(frontend, ticked_seq);
+				chip8->dirty_rows = 0;
+			}
+			if(frontend->gdb.listener >= 0) SDL_SemWaitTimeout(frontend->wake, 10);
+			else SDL_SemWait(frontend->wake);
+			next_tick = SDL_GetPerformanceCounter();	//What woke it gets a tick right away
+			continue;
+		}
+
+		const double ticks_per_sec = 60 * (SDL_AtomicGet(&frontend->fast_forward) ? 8 : SDL_AtomicGet(&frontend->speed) / 8.0);
+		const uint64_t period = freq / ticks_per_sec;
+		const uint64_t now = SDL_GetPerformanceCounter();
+		if((int64_t)(now - next_tick) > (int64_t)(max_late_ticks * period)) next_tick = now;
+
+		for(; (int64_t)(now - next_tick) >= 0; next_tick += period){
+			if(rewinding){
+				//A rewound frame is cut from the movie too, so it replays the timeline that was kept
+				if(step_rewind(&frontend->rewind,chip8,config) && frontend->recording && frontend->movie.frame_count)
+					frontend->movie.frame_count--;
+				continue;
+			}
+
+			//A tick gdb halted in the middle of is recorded once, when it started
+			if(frontend->recording && !chip8->tick_left && !record_movie_frame(&frontend->movie,keypad_mask(chip8)))
+				frontend->recording = false;
+
+			emulate_tick(chip8,config);
+			if(chip8->tick_left) break;
+
+			//The tick's sound is made from the state it ended in, before the timers count down
+			int16_t sound[8192];
+			const uint32_t samples = synth_tick(&frontend->synth,chip8,ticks_per_sec / 60,sound,sizeof sound / sizeof *sound);
+			audio_ring_write(frontend->audio_ring,sound,samples,samples + frontend->synth.sample_rate / 20);
+
+			update_timer(chip8);
+			capture_rewind(&frontend->rewind,chip8);
+			ticked_seq = input_seq;
+		}
+
+		if(chip8->dirty_rows){
+			publish_frame(frontend, ticked_seq);
+			chip8->dirty_rows = 0;
+		}
+
+		//Sleep until a millisecond before the next tick is due, unless the main thread sends something first,
+		//then sleep out the rest. nanosleep() is good to the timer slack, tens of microseconds
+		const int64_t remaining = next_tick - SDL_GetPerformanceCounter();
+		if(remaining > (int64_t)sleep_margin &&
+		   SDL_SemWaitTimeout(frontend->wake, (remaining - sleep_margin) * 1000 / freq) == 0)
+			continue;
+
+		const int64_t left = next_tick - SDL_GetPerformanceCounter();
+		if(left > 0){
+			const uint64_t ns = left * 1e9 / freq;
+			nanosleep(&(struct timespec){.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000}, NULL);
+		}
+	}
+
+	return 0;
+}
+
+typedef struct{
+	uint32_t frame;
+	uint16_t keys;
+}input_event_t;
+
+typedef struct{
+	bool from_movie;
+	uint32_t rng_seed;
+	uint32_t inst_per_sec;
+	extension_t extension;
+	uint32_t quirks;
+}input_timing_t;
+
+typedef struct{
+	const char *rom_name;
+	const config_t *config;		//Shared by every copy of a manifest line
+	int line;
+	uint32_t frames;
+	const input_event_t *inputs;
+	uint32_t input_count;
+	input_timing_t timing;
+	bool ok;
+	uint64_t insts;
+	uint32_t hash;
+}batch_job_t;
+
+typedef struct{
+	SDL_atomic_t next;
+	int end;
+}batch_queue_t;
+
+typedef struct{
+	batch_job_t *jobs;
+	batch_queue_t *queues;
+	uint32_t queue_count;
+	uint32_t id;
+}batch_worker_t;
+
+bool load_input_script(const char *path, input_event_t **inputs, uint32_t *count, input_timing_t *timing){
+	//Text input script, one "<frame> <keypad bitmask in hex>" per line; keys stay held until the next line.
+	//An input movie from --record works too, and also brings its RNG seed, instruction rate, extension and quirks
+	FILE *file = fopen(path,"r");
+	if(!file){
+		SDL_Log("Input script %s is invalid or does not exist\n",path);
+		return false;
+	}
+
+	if(fget_le(file, 4) == MOVIE_MAGIC){
+		fclose(file);
+
+		movie_t movie;
+		if(!load_movie(&movie, path)) return false;
+
+		*count = 0;
+		*inputs = malloc((movie.frame_count ? movie.frame_count : 1) * sizeof **inputs);
+		for(uint32_t f = 0; *inputs && f < movie.frame_count; f++){
+			if(f == 0 || movie.keys[f] != movie.keys[f-1])
+				(*inputs)[(*count)++] = (input_event_t){.frame = f, .keys = movie.keys[f]};
+		}
+
+		*timing = (input_timing_t){.from_movie = true, .rng_seed = movie.rng_seed,
+								   .inst_per_sec = movie.inst_per_sec, .extension = movie.extension,
+								   .quirks = movie.quirks};
+		free(movie.keys);
+
+		if(!*inputs){
+			SDL_Log("Could not allocate input script %s\n",path);
+			return false;
+		}
+		return true;
+	}
+	rewind(file);
+
+	uint32_t capacity = 64;
+	*count = 0;
+	*inputs = malloc(capacity * sizeof **inputs);
+
+	unsigned frame, keys;
+	while(*inputs && fscanf(file,"%u %x",&frame,&keys) == 2){
+		if(*count == capacity){
+			capacity *= 2;
+			input_event_t *grown = realloc(*inputs, capacity * sizeof **inputs);
+			if(!grown){
+				free(*inputs);
+				*inputs = NULL;
+				break;
+			}
+			*inputs = grown;
+		}
+		(*inputs)[(*count)++] = (input_event_t){.frame = frame, .keys = keys};
+	}
+
+	fclose(file);
+
+	if(!*inputs){
+		SDL_Log("Could not allocate input script %s\n",path);
+		return false;
+	}
+	return true;
+}
+
+void run_batch_job(batch_job_t *job){
+	const config_t *config = job->config;
+	chip8_t *chip8 = malloc(sizeof *chip8);
+
+	job->ok = chip8 && init_chip8(chip8,*config,job->rom_name);
+	if(!job->ok){
+		free(chip8);
+		return;
+	}
+
+	uint32_t next_input = 0;
+	job->insts = 0;
+
+	for(uint32_t frame = 0; frame < job->frames; frame++){
+		while(next_input < job->input_count && job->inputs[next_input].frame <= frame)
+			set_keypad_mask(chip8, job->inputs[next_input++].keys);
+
+		job->insts += emulate_frame(chip8,config,NULL);
+	}
+
+	job->hash = hash_state(chip8);
+	free_chip8(chip8);
+	free(chip8);
+}
+
+int batch_worker(void *data){
+	//Drain our own queue first, then steal from the others; a job index past a queue's end just means it's empty
+	batch_worker_t *worker = data;
+
+	for(uint32_t q = 0; q < worker->queue_count; q++){
+		batch_queue_t *queue = &worker->queues[(worker->id + q) % worker->queue_count];
+
+		for(int job = SDL_AtomicAdd(&queue->next, 1); job < queue->end; job = SDL_AtomicAdd(&queue->next, 1))
+			run_batch_job(&worker->jobs[job]);
+	}
+
+	return 0;
+}
+
+double run_batch_jobs(batch_job_t *jobs, const int job_count, const uint32_t threads){
+	//Split the jobs into one contiguous queue per worker thread and wait for all of them. Returns wall time
+	batch_queue_t *queues = calloc(threads, sizeof *queues);
+	batch_worker_t *workers = calloc(threads, sizeof *workers);
+	SDL_Thread **handles = calloc(threads, sizeof *handles);
+
+	if(!queues || !workers || !handles){
+		SDL_Log("Could not allocate batch workers\n");
+		free(queues);
+		free(workers);
+		free(handles);
+		return -1;
+	}
+
+	const uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for(uint32_t t = 0; t < threads; t++){
+		SDL_AtomicSet(&queues[t].next, (int)((uint64_t)job_count * t / threads));
+		queues[t].end = (int)((uint64_t)job_count * (t+1) / threads);
+		workers[t] = (batch_worker_t){.jobs = jobs, .queues = queues,
+									  .queue_count = threads, .id = t};
+	}
+
+	for(uint32_t t = 1; t < threads; t++)
+		handles[t] = SDL_CreateThread(batch_worker, "chip8 batch", &workers[t]);
+
+	batch_worker(&workers[0]);
+
+	for(uint32_t t = 1; t < threads; t++){
+		if(handles[t]) SDL_WaitThread(handles[t], NULL);
+	}
+
+	const double secs = (SDL_GetPerformanceCounter() - start_time) / (double)SDL_GetPerformanceFrequency();
+
+	free(queues);
+	free(workers);
+	free(handles);
+	return secs;
+}
+
+bool run_batch(const config_t config){
+	//Every manifest line is "<rom> [frames] [input script]" and becomes config.batch_copies instances,
+	//all running the line's config: the ROM's profile, or the movie's settings when the script is a movie
+	FILE *manifest = fopen(config.batch_file,"r");
+	if(!manifest){
+		SDL_Log("Batch manifest %s is invalid or does not exist\n",config.batch_file);
+		return false;
+	}
 
-		case 0x09 : 
-			//0x9XY0 : if VX != VY skip the next instruction
-			printf("if V%X (0x%02X) != V%X (0x%02X) skip next instruction ",
-					chip8->inst.X,chip8->V[chip8->inst.X],
-					chip8->inst.Y,chip8->V[chip8->inst.Y]);
-			break;
-		
-		case 0x0A :
-			//0xANNN : Set index register I to NNN
-			printf("Set I to NNN (0x%04X)\n",chip8->inst.NNN);
+	batch_job_t *jobs = NULL;
+	char **names = NULL;
+	config_t *configs = NULL;
+	input_event_t **scripts = NULL;
+	int job_count = 0;
+	int line_count = 0;
+	bool ok = true;
+	char line[1024];
+
+	while(ok && fgets(line,sizeof line,manifest)){
+		char rom[512] = {0}, script[512] = {0};
+		unsigned frames = config.bench_frames;
+
+		if(sscanf(line,"%511s %u %511s",rom,&frames,script) < 1 || rom[0] == '#') continue;
+
+		char **grown_names = realloc(names, (line_count+1) * sizeof *names);
+		config_t *grown_configs = realloc(configs, (line_count+1) * sizeof *configs);
+		input_event_t **grown_scripts = realloc(scripts, (line_count+1) * sizeof *scripts);
+		batch_job_t *grown_jobs = realloc(jobs, (job_count + config.batch_copies) * sizeof *jobs);
+		if(grown_names) names = grown_names;
+		if(grown_configs) configs = grown_configs;
+		if(grown_scripts) scripts = grown_scripts;
+		if(grown_jobs) jobs = grown_jobs;
+		if(!grown_names || !grown_configs || !grown_scripts || !grown_jobs){
+			SDL_Log("Could not allocate batch jobs\n");
+			ok = false;
 			break;
+		}
 
-		case 0x0B :
-			//0xBNNN : Jump to V0 + NNN
-			printf("Set PC to V0 (0x%02X) + NNN (0x%04X). Result : 0x%04X",
-				   chip8->V[0],chip8->inst.NNN,
-				   chip8->V[0] + chip8->inst.NNN);
-			break;
-		
-		case 0x0C : 
-			//0xCXNN : Setx VX = rand() % 256 & NN
-			printf("Setx V%X = rand() %% 256 & NN (0x%02X)\n",chip8->inst.X,chip8->inst.NN);
+		names[line_count] = SDL_strdup(rom);
+		if(!names[line_count]){
+			SDL_Log("Could not allocate batch jobs\n");
+			ok = false;
 			break;
+		}
+		scripts[line_count] = NULL;
+		uint32_t input_count = 0;
+		input_timing_t timing = {0};
+
+		if(script[0] && strcmp(script,"-") != 0)
+			ok = load_input_script(script,&scripts[line_count],&input_count,&timing);
+
+		ok = ok && config_for_rom(&config,rom,&configs[line_count]);
+		if(timing.from_movie){
+			configs[line_count].rng_seed = timing.rng_seed;
+			configs[line_count].inst_per_sec = timing.inst_per_sec;
+			configs[line_count].current_extension = timing.extension;
+			configs[line_count].quirks = timing.quirks;
+		}
 
-		case 0x0D :
-			//0xDXYN : Draw N-height sprite at coords X,Y; Read from I
-			printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) , Read from I (0x%04X)\n",
-					chip8->inst.N, chip8->inst.X,chip8->V[chip8->inst.X],chip8->inst.Y,
-					chip8->V[chip8->inst.Y],chip8->I);
-			break;
+		for(uint32_t c = 0; c < config.batch_copies; c++){
+			jobs[job_count++] = (batch_job_t){.rom_name = names[line_count], .line = line_count, .frames = frames,
+											  .inputs = scripts[line_count], .input_count = input_count,
+											  .timing = timing};
+		}
+		line_count++;
+	}
 
-		case 0x0E :
-			if(chip8->inst.NN == 0x9E){
-				//0xEX9E : Skip next instruction if key in VX is pressed 
-				printf("Skip next instruction if key in V%X (0x%02X) is pressed, key : %d\n",
-						chip8->inst.X,chip8->V[chip8->inst.X],
-						chip8->keypad[chip8->V[chip8->inst.X]]);
-			}
-			else if(chip8->inst.NN == 0xA1){
-				//0xEX9E : Skip next instruction if key in VX is not pressed 
-				printf("Skip next instruction if key in V%X (0x%02X) is not pressed, key : %d\n",
-						chip8->inst.X,chip8->V[chip8->inst.X],
-						chip8->keypad[chip8->V[chip8->inst.X]]);
-			}
-			break;
+	fclose(manifest);
 
-		case 0x0F : 
-			switch(chip8->inst.NN){
-				case 0x0A :
-					//0xFX0A : VX = get_key(); Await until a keypress, and store in VX
-					printf("Await until a keypress, and store in V%X\n",chip8->inst.X);
-					break;
+	//configs moved while it grew, so the jobs only point into it once it's complete
+	for(int j = 0; j < job_count; j++)
+		jobs[j].config = &configs[jobs[j].line];
 
-				case 0x1E :
-						//0xFX1E : I += VX
-						printf("I (0x%04X) += V%X (0x%02X). Result : 0x%04X\n",
-								chip8->I,chip8->inst.X,chip8->V[chip8->inst.X],
-								chip8->I + chip8->V[chip8->inst.X]);
-						break;
+	if(ok && job_count == 0){
+		SDL_Log("Batch manifest %s has no jobs\n",config.batch_file);
+		ok = false;
+	}
 
-				case 0x07 :
-						//0xFX07 : VX = delay timer
-						printf("V%X = delay timer (0x%02X)\n",chip8->inst.X,chip8->delay_timer);
-						break;
+	//Either run once on every thread, or at 1, 2, 4 ... threads to show how the batch scales
+	const uint32_t max_threads = config.batch_threads ? config.batch_threads : (uint32_t)SDL_GetCPUCount();
+	double base_rate = 0;
 
-				case 0x15 :
-						//0xFX15 : delay timer = VX
-						printf("delay timer = V%X (0x%02X)\n",chip8->inst.X,chip8->V[chip8->inst.X]);
-						break;
-				
-				case 0x18 :
-						//0xFX18 : sound timer = VX
-						printf("sound timer = V%X (0x%02X)\n",chip8->inst.X,chip8->V[chip8->inst.X]);;
-						break;
-				
-				case 0x29 :
-						//0xFX29 : I = sprite location in VX
-						printf("I = sprite location in V%X (0x%02X). Result = (0x%02X)\n",
-						chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] * 5);
-						break;
+	for(uint32_t threads = config.batch_scaling ? 1 : max_threads; ok; threads *= 2){
+		if(threads > max_threads) threads = max_threads;
 
-				case 0x33 :
-					//0xFX33 : Store BCD representation of VX at memory offset from I
-					printf("Store BCD representation of V%X (0x%02X) at memory offset from I (0x%04X)\n",
-							chip8->inst.X, chip8->V[chip8->inst.X],chip8->I);
-					break;
+		const double secs = run_batch_jobs(jobs, job_count, threads);
+		if(secs < 0){
+			ok = false;
+			break;
+		}
 
-				case 0x55 :
-					//0xFX55 : Register dumpp V0 - VX inclusive to memory offset from I
-					printf("Register dumpp V0 - V%X (0x%02X) inclusive at memory offset from I (0x%04X)\n",
-							chip8->inst.X, chip8->V[chip8->inst.X],chip8->I);
-					break;
+		uint64_t insts = 0;
+		int failed = 0;
+		for(int j = 0; j < job_count; j++){
+			insts += jobs[j].insts;
+			failed += !jobs[j].ok;
+		}
 
-				case 0x65 :
-					//0xFX65 : Register load V0 - VX inclusive from memory offset from I
-					printf("Register load V0 - V%X (0x%02X) inclusive at memory offset from I (0x%04X)\n",
-							chip8->inst.X, chip8->V[chip8->inst.X],chip8->I);
-					break;
+		const double rate = secs > 0 ? insts / secs : 0;
+		if(!base_rate) base_rate = rate;
 
-				default : 
-					break;
-			}
-			break;
+		printf("%6d instances %3u threads %8.3f s | %10.2f M inst/s | %5.2fx | %d failed\n",
+			   job_count, threads, secs, rate / 1e6, base_rate ? rate / base_rate : 0, failed);
 
-		default :
-			printf("unimplemented\n");
+		if(failed) ok = false;
+		if(threads == max_threads) break;
 	}
-}
-#endif
 
-void emulate_instruction(chip8_t *chip8,const config_t config){
+	for(int l = 0; l < line_count; l++){
+		SDL_free(names[l]);
+		free(scripts[l]);
+	}
+	free(names);
+	free(configs);
+	free(scripts);
+	free(jobs);
 
-	bool carry;
+	return ok;
+}
 
-	chip8->inst.opcode = (chip8->ram[chip8->PC]<<8) | chip8->ram[chip8->PC+1];
-	chip8->PC += 2;
+bool print_rom_hashes(const config_t config){
+	//The hashes the profile database is keyed by, with the settings each ROM currently resolves to
+	for(int r = 0; r < config.rom_count; r++){
+		uint32_t hash;
+		config_t rom_config;
 
-	chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;	
-	chip8->inst.NN = chip8->inst.opcode & 0x0FF;	
-	chip8->inst.N = chip8->inst.opcode & 0x0F;	
-	chip8->inst.X = (chip8->inst.opcode >>8) & 0x0F;	
-	chip8->inst.Y = (chip8->inst.opcode >>4) & 0x0F;
+		if(!hash_rom_file(config.rom_names[r],&hash)){
+			SDL_Log("Rom file %s is invalid or does not exist\n",config.rom_names[r]);
+			return false;
+		}
+		if(!config_for_rom(&config,config.rom_names[r],&rom_config)) return false;
+
+		const char *extensions[] = {[CHIP8] = "chip8", [SUPERCHIP] = "schip", [XOCHIP] = "xochip"};
+		printf("%08X extension=%s ips=%u quirk-vf-reset=%d quirk-shift=%d quirk-load-store=%d quirk-clip=%d quirk-jump=%d  # %s\n",
+			   hash, extensions[rom_config.current_extension], rom_config.inst_per_sec,
+			   !!(rom_config.quirks & QUIRK_VF_RESET), !!(rom_config.quirks & QUIRK_SHIFT),
+			   !!(rom_config.quirks & QUIRK_LOAD_STORE), !!(rom_config.quirks & QUIRK_CLIP),
+			   !!(rom_config.quirks & QUIRK_JUMP), config.rom_names[r]);
+	}
+	return true;
+}
 
-#ifdef DEBUG
-	print_debug_info(chip8);
-#endif
+bool decode_trace_file(const char *path, const config_t *config){
+	//Print every instruction of every dump in a trace file with print_instruction(). The registers an
+	//instruction reads are rebuilt from the I and VX recorded after the ones before it, so values a
+	//dump never saw written read as 0
+	FILE *file = fopen(path,"rb");
+	if(!file){
+		SDL_Log("Trace %s is invalid or does not exist\n",path);
+		return false;
+	}
 
-	switch((chip8->inst.opcode>>12) & 0x0F){
-		case 0x00 :
-			if(chip8->inst.NN == 0xE0){
-				//0x00E0 : Clear the screen
-				memset(&chip8->display[0],false,sizeof chip8->display);
-				chip8->draw = true;
-			}
-			else if(chip8->inst.NN == 0xEE){
-				//0x00EE : Return from subroutine
-				chip8->PC = *--chip8->stack_ptr;
-			}
-			break;
+	static chip8_t shadow;
+	static uint8_t ram[0x10000];
+	bool ok = true;
 
-		case 0x01:
-			//0x1NNN : Jump to address NNN
-			chip8->PC = chip8->inst.NNN;
-			break;
+	for(uint32_t dump = 0; ok; dump++){
+		const uint32_t magic = fget_le(file, 4);
+		if(feof(file) && dump) break;
 
-		case 0x02 :
-			//0x2NNN : Call subroutine at NNN
-			*chip8->stack_ptr++ = chip8->PC;
-			chip8->PC = chip8->inst.NNN;
+		if(magic != TRACE_MAGIC || fget_le(file, 2) != TRACE_VERSION){
+			SDL_Log("%s is not a supported trace\n",path);
+			ok = false;
 			break;
+		}
 
-		case 0x03 : 
-			//0x3XNN : if(VX == NN) skip next instruction
-			if(chip8->V[chip8->inst.X] == chip8->inst.NN)
-				chip8->PC += 2;
-			break;
-		
-		case 0x04 : 
-			//0x4XNN : if(VX != NN) skip next instruction
-			if(chip8->V[chip8->inst.X] != chip8->inst.NN)
-				chip8->PC += 2;
+		const uint32_t count = fget_le(file, 4);
+		trace_entry_t *entries = malloc((count ? count : 1) * sizeof *entries);
+		uint32_t *cycles = malloc((count ? count : 1) * sizeof *cycles);
+		if(!entries || !cycles){
+			SDL_Log("Could not allocate %u trace entries\n",count);
+			free(entries);
+			free(cycles);
+			ok = false;
 			break;
+		}
 
-		case 0x05 : 
-			//0x5XY0 : if(VX == VY) skip next instruction
-			if(chip8->inst.N != 0) break;
-
-			if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y])
-				chip8->PC += 2;
-			break;
+		for(uint32_t e = 0; e < count; e++){
+			cycles[e] = fget_le(file, 4);
+			entries[e].PC = fget_le(file, 2);
+			entries[e].opcode = fget_le(file, 2);
+			entries[e].I = fget_le(file, 2);
+			entries[e].X = fget_le(file, 1);
+			entries[e].VX = fget_le(file, 1);
+		}
 
-		case 0x06 :
-			//0x6xNN : Set register VX to NN
-			chip8->V[chip8->inst.X] = chip8->inst.NN;
-			break;
-		
-		case 0x07 :
-			//0x7xNN : Set register VX += NN
-			chip8->V[chip8->inst.X] += chip8->inst.NN;
+		if(feof(file)){
+			SDL_Log("Trace %s is truncated\n",path);
+			free(entries);
+			free(cycles);
+			ok = false;
 			break;
+		}
 
-		case 0x08 :
-			switch(chip8->inst.N){
-				case 0 :
-					//0x8XY0 : Set register VX to VY
-					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-					break;
+		memset(&shadow, 0, sizeof shadow);
+		memset(ram, 0, sizeof ram);
+		shadow.ram = ram;
+		shadow.ram_size = sizeof ram;
+		shadow.stack_ptr = &shadow.stack[1];
+
+		printf("%s dump %u: %u instructions\n",path,dump,count);
+
+		for(uint32_t e = 0; e < count; e++){
+			const trace_entry_t *entry = &entries[e];
+			decoded_t decoded;
+			decode_instruction(&decoded, entry->opcode, config);
+
+			//The few descriptions that read more than registers get it from the entries around them
+			if(entry->opcode == 0x00EE)
+				shadow.stack[0] = e + 1 < count ? entries[e + 1].PC : 0;
+			if((entry->opcode & 0xF0FF) == 0xF007)
+				shadow.delay_timer = entry->VX;
+			if(entry->opcode == 0xF000){
+				ram[(entry->PC + 2) & 0xFFFF] = entry->I >> 8;
+				ram[(entry->PC + 3) & 0xFFFF] = entry->I & 0xFF;
+			}
 
-				case 1 :
-					//0x8XY1 : Set register VX |= VY
-					chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-					if(config.current_extension == CHIP8){
-						chip8->V[0xF] = 0;
-					}
-					break;	
-				
-				case 2 :
-					//0x8XY2 : Set register VX &= VY
-					chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-					if(config.current_extension == CHIP8){
-						chip8->V[0xF] = 0;
-					}
-					break;
+			printf("%10u ",cycles[e]);
+			print_instruction(stdout, &shadow, entry->PC, &decoded.inst);
 
-				case 3 :
-					//0x8XY3 : Set register VX ^= VY
-					chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-					if(config.current_extension == CHIP8){
-						chip8->V[0xF] = 0;
-					}
-					break;
+			shadow.I = entry->I;
+			shadow.V[entry->X] = entry->VX;
+		}
 
-				case 4 :
-					//0x8XY4 : Set register VX += VY and VF = 1 if carry
-					carry = ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255);
+		free(entries);
+		free(cycles);
+	}
 
-					chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-					chip8->V[0xF] = carry;
-					break;
-				
-				case 5 :
-					//0x8XY5 : Set register VX -= VY and VF = 1 if no borrow
-					carry = chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y];		
+	fclose(file);
+	return ok;
+}
 
-					chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-					chip8->V[0xF] = carry;
-					break;
+bool decode_traces(const config_t config){
+	for(int t = 0; t < config.rom_count; t++){
+		if(!decode_trace_file(config.rom_names[t], &config)) return false;
+	}
+	return true;
+}
 
-				case 6 :
-					//0x8XY6 : Set register VX >>= 1, store shifted bit in VF
-					if(config.current_extension == CHIP8){
-						carry = chip8->V[chip8->inst.Y] & 1;
-						chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1; 
-					}
-					else{
-						carry = chip8->V[chip8->inst.X] & 1;
-						chip8->V[chip8->inst.X] >>= 1;
-					}
-
-					chip8->V[0xF] = carry;
-					break;
-				
-				case 7 :
-					//0x8XY7 : Set register VX = VY - VX and VF = 1 if no borrow
-					carry = chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y];		
+bool run_headless(const config_t base_config){
+	//Run every rom uncapped with no window/audio and report the core throughput.
+	//With --wav the sound of every rom goes to the file, one after another, and the same for --trace
+	const double freq = SDL_GetPerformanceFrequency();
+	uint64_t total_insts = 0;
+	double total_time = 0;
+	bool ok = true;
 
-					chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-					chip8->V[0xF] = carry;
-					break;
+	wav_t wav;
+	if(base_config.wav_file && !open_wav(&wav,base_config.wav_file,&base_config)) return false;
 
-				case 0xE :
-					//0x8XYE : Set register VX <<= 1, store shifted bit in VF
-					if(config.current_extension == CHIP8){
-						carry = (chip8->V[chip8->inst.Y] & 0x80) >> 7;
-						chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1; 
-					}
-					else{
-						carry = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-						chip8->V[chip8->inst.X] <<= 1;
-					}
-
-					chip8->V[0xF] = carry;
-					break;
+	FILE *trace = base_config.trace_file ? fopen(base_config.trace_file,"wb") : NULL;
+	if(base_config.trace_file && !trace){
+		SDL_Log("Could not write trace %s\n",base_config.trace_file);
+		return false;
+	}
 
-				default :
-					break;
-			}
-			break;
-		
-		case 0x09 : 
-			//0x9XY0 : if VX != VY skip the next instruction
-			if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
-				chip8->PC += 2;
-			break;
+	//The profile report goes to --profile and the folded stacks to <file>.folded, each ROM after the last
+	FILE *report = NULL;
+	FILE *folded = NULL;
+	if(base_config.profile_file){
+		char folded_path[1024];
+		snprintf(folded_path, sizeof folded_path, "%s.folded", base_config.profile_file);
+		report = fopen(base_config.profile_file,"w");
+		folded = fopen(folded_path,"w");
+
+		if(!report || !folded){
+			SDL_Log("Could not write profile %s\n",base_config.profile_file);
+			if(report) fclose(report);
+			if(folded) fclose(folded);
+			if(trace) fclose(trace);
+			return false;
+		}
+	}
 
-		case 0x0A :
-			//0xANNN : Set index register I to NNN
-			chip8->I = chip8->inst.NNN;
-			break;
+	static chip8_t chip8;
+	static debugger_t debugger;
+	gdb_stub_t gdb;
+	if(!open_gdb_stub(&gdb, base_config.gdb_port, &debugger)){
+		if(report) fclose(report);
+		if(folded) fclose(folded);
+		if(trace) fclose(trace);
+		return false;
+	}
 
-		case 0x0B :
-			//0xBNNN : Jump to V0 + NNN
-			chip8->PC = chip8->V[0] + chip8->inst.NNN;
-			break;
-		
-		case 0x0C : 
-			//0xCXNN : Setx VX = rand() % 256 & NN
-			chip8->V[chip8->inst.X] = rand() % 256 & chip8->inst.NN;
+	for(int r = 0; ok && r < base_config.rom_count; r++){
+		config_t config;
+		if(!config_for_rom(&base_config,base_config.rom_names[r],&config) ||
+		   !init_chip8(&chip8,config,config.rom_names[r]) || (trace && !start_trace(&chip8)) ||
+		   (report && !start_profile(&chip8))){
+			stop_trace(&chip8);
+			ok = false;
 			break;
+		}
 
-		case 0x0D :
-			//0xDXYN : Draw N-height sprite at coords X,Y; Read from I	
-			uint8_t X_coord = chip8->V[chip8->inst.X] % config.window_width;
-			uint8_t Y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-			const uint8_t orig_X = X_coord;
-
-			chip8->V[0xF] = 0;
+		//--debug stops before the first instruction of every ROM
+		if(config.debug){
+			memset(&debugger, 0, sizeof debugger);
+			debugger_break_in(&debugger, &chip8);
+		}
 
-			for(uint8_t i = 0; i < chip8->inst.N; i++){
-				
-				const uint8_t sprite_data = chip8->ram[chip8->I + i];
-				X_coord = orig_X;
+		//gdb gets every ROM stopped before its first instruction
+		if(gdb.listener >= 0){
+			debugger.remote = true;
+			debugger.halted = true;
+		}
 
-				for(int8_t j = 7; j >= 0 ; j--){
-					
-					bool *pixel = &chip8->display[Y_coord*config.window_width + X_coord];
-					const bool sprite_bit = (sprite_data & (1 << j));
-					
-					if(sprite_bit && *pixel){
-						chip8->V[0xF] = 1;
-					}
+		uint64_t insts = 0;
+		uint64_t frames = 0;
 
-					*pixel ^= sprite_bit;
+		const uint64_t start_time = SDL_GetPerformanceCounter();
 
-					if(++X_coord >= config.window_width) break;
-				}
+		//--insts counts emulated instructions, skipped waits included, so a ROM parked on FX0A still ends
+		while((config.bench_frames && frames < config.bench_frames) ||
+			  (config.bench_insts && insts + chip8.skipped < config.bench_insts)){
 
-				if(++Y_coord >= config.window_height) break;
+			//gdb is polled every 64 frames, and every 10ms while it has the machine halted
+			if(gdb.listener >= 0 && (debugger.halted || !(frames & 63))){
+				gdb_poll(&gdb, &chip8, debugger.halted ? 10 : 0);
+				if(debugger.halted) continue;
 			}
-			chip8->draw = true;
-			break;
 
-		case 0x0E :
-			if(chip8->inst.NN == 0x9E){
-				//0xEX9E : Skip next instruction if key in VX is pressed 
-				if(chip8->keypad[chip8->V[chip8->inst.X]])
-					chip8->PC += 2;
-			}
-			else if(chip8->inst.NN == 0xA1){
-				//0xEX9E : Skip next instruction if key in VX is not pressed 
-				if(!chip8->keypad[chip8->V[chip8->inst.X]])
-					chip8->PC += 2;
-			}
-			break;
+			insts += emulate_frame(&chip8,&config,base_config.wav_file ? &wav : NULL);
+			frames += !chip8.tick_left;
+		}
 
-		case 0x0F : 
-			switch(chip8->inst.NN){
-				case 0x0A :
-					//0xFX0A : VX = get_key(); Await until a keypress, and store in VX
-					static bool any_key_pressed = false;
-					static uint8_t key = 0xFF;
-						for(uint8_t i = 0; key == 0xFF && i < sizeof chip8->keypad; i++){
-							if(chip8->keypad[i]){
-								key = i;
-								any_key_pressed = true;
-								break;
-							}
-						}
-					if(!any_key_pressed) chip8->PC -= 2;
-					else{
-						if(chip8->keypad[key])
-							chip8->PC -= 2;
-						else{
-							chip8->V[chip8->inst.X] = key;
-							key = 0xFF;
-							any_key_pressed = false;
-						}
-					}
-					break;
+		const double secs = (SDL_GetPerformanceCounter() - start_time) / freq;
 
-				case 0x1E :
-						//0xFX1E : I += VX
-						chip8->I += chip8->V[chip8->inst.X];
-						break;
-					
-				case 0x07 :
-						//0xFX07 : VX = delay timer
-						chip8->V[chip8->inst.X] = chip8->delay_timer;
-						break;
+		printf("%-24s %10llu insts %10llu skipped %8llu frames %8.3f s | %8.2f M inst/s %10.0f frames/s %7.2f ns/inst | state %08X\n",
+			   config.rom_names[r],(long long unsigned)insts,(long long unsigned)chip8.skipped,
+			   (long long unsigned)frames,secs,insts / secs / 1e6, frames / secs,
+			   insts ? secs * 1e9 / insts : 0, hash_state(&chip8));
 
-				case 0x15 :
-						//0xFX15 : delay timer = VX
-						chip8->delay_timer = chip8->V[chip8->inst.X];
-						break;
-				
-				case 0x18 :
-						//0xFX18 : sound timer = VX
-						chip8->sound_timer = chip8->V[chip8->inst.X];
-						break;
+		total_insts += insts;
+		total_time += secs;
+		if(trace && !save_trace(&chip8,trace)){
+			SDL_Log("Could not write trace %s\n",base_config.trace_file);
+			ok = false;
+		}
+		if(report && !write_profile(&chip8,report,folded)){
+			SDL_Log("Could not write profile %s\n",base_config.profile_file);
+			ok = false;
+		}
+		stop_trace(&chip8);
+		stop_profile(&chip8);
+		free_chip8(&chip8);
+	}
 
-				case 0x29 :
-						//0xFX29 : I = sprite location in VX
-						chip8->I = chip8->V[chip8->inst.X] * 5;
-						break;
+	if(ok && base_config.rom_count > 1)
+		printf("%-24s %10llu insts %8s %8.3f s | %8.2f M inst/s\n","total",
+			   (long long unsigned)total_insts,"",total_time,total_insts / total_time / 1e6);
 
-				case 0x33 :
-					//0xFX33 : Store BCD representation of VX at memory offset from I
-					uint8_t BCD = chip8->V[chip8->inst.X];
-					chip8->ram[chip8->I + 2] = BCD % 10;
-					BCD /= 10; 
-					chip8->ram[chip8->I + 1] = BCD % 10;
-					BCD /= 10; 
-					chip8->ram[chip8->I] = BCD;
-					break;
-				
-				case 0x55 :
-					//0xFX55 : Register dumpp V0 - VX inclusive to memory offset from I
-					for(uint8_t i = 0; i <= chip8->inst.X; i++){
-						if(config.current_extension == CHIP8) 
-							chip8->ram[chip8->I++] = chip8->V[i];
-						else
-							chip8->ram[chip8->I + i] = chip8->V[i];
-					}	
-					break;
+	close_gdb_stub(&gdb);
+	if(base_config.wav_file && !close_wav(&wav)) ok = false;
+	if(trace && fclose(trace) != 0){
+		SDL_Log("Could not write trace %s\n",base_config.trace_file);
+		ok = false;
+	}
+	if(report && (fclose(report) | fclose(folded)) != 0){
+		SDL_Log("Could not write profile %s\n",base_config.profile_file);
+		ok = false;
+	}
 
-				case 0x65 :
-					//0xFX65 : Register load V0 - VX inclusive from memory offset from I
-					for(uint8_t i = 0; i <= chip8->inst.X; i++){
-						if(config.current_extension == CHIP8) 
-							chip8->V[i] = chip8->ram[chip8->I++];
-						else
-							chip8->V[i] = chip8->ram[chip8->I + i];
-					}
-					break;	
+	return ok;
+}
 
-				default : 
-					break;
-			}
-			break;
+bool run_replay(const config_t base_config){
+	//Play an input movie back headlessly, as fast as possible, and report the final state
+	movie_t movie;
+	if(!load_movie(&movie,base_config.replay_file)) return false;
 
-		default :
-			break;
+	//The movie's settings win over the ROM profile and command line, anything else would desync it
+	config_t config;
+	if(!config_for_rom(&base_config,base_config.rom_names[0],&config)){
+		free(movie.keys);
+		return false;
+	}
+	config.rng_seed = movie.rng_seed;
+	config.inst_per_sec = movie.inst_per_sec;
+	config.current_extension = movie.extension;
+	config.quirks = movie.quirks;
+
+	static chip8_t chip8;
+	if(!init_chip8(&chip8,config,config.rom_names[0]) || (config.trace_file && !start_trace(&chip8)) ||
+	   (config.profile_file && !start_profile(&chip8))){
+		stop_trace(&chip8);
+		free_chip8(&chip8);
+		free(movie.keys);
+		return false;
 	}
-}
 
-void update_timer(const sdl_t sdl,chip8_t *chip8){
-	if(chip8->delay_timer > 0)
-		chip8->delay_timer--;
-	
-	if(chip8->sound_timer > 0){
-		chip8->sound_timer--; 
-		SDL_PauseAudioDevice(sdl.dev, 0);
+	static debugger_t debugger;
+	if(config.debug) debugger_break_in(&debugger, &chip8);
+
+	if(hash_rom(&chip8) != movie.rom_hash)
+		SDL_Log("Warning: %s was recorded with a different ROM than %s\n",config.replay_file,config.rom_names[0]);
+
+	wav_t wav;
+	if(config.wav_file && !open_wav(&wav,config.wav_file,&config)){
+		stop_trace(&chip8);
+		stop_profile(&chip8);
+		free_chip8(&chip8);
+		free(movie.keys);
+		return false;
 	}
-	else{
-		SDL_PauseAudioDevice(sdl.dev, 1);
+
+	const uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for(uint32_t frame = 0; frame < movie.frame_count; frame++){
+		set_keypad_mask(&chip8, movie.keys[frame]);
+		emulate_frame(&chip8,&config,config.wav_file ? &wav : NULL);
 	}
+
+	const double secs = (SDL_GetPerformanceCounter() - start_time) / (double)SDL_GetPerformanceFrequency();
+
+	printf("%s: %u frames in %.3f s (%.0fx real time) | state %08X\n",
+		   config.replay_file, movie.frame_count, secs, movie.frame_count / 60.0 / secs, hash_state(&chip8));
+
+	bool ok = !config.wav_file || close_wav(&wav);
+	if(config.trace_file && !save_trace_file(&chip8,config.trace_file)) ok = false;
+	if(config.profile_file && !save_profile_file(&chip8,config.profile_file)) ok = false;
+
+	stop_trace(&chip8);
+	stop_profile(&chip8);
+	free_chip8(&chip8);
+	free(movie.keys);
+	return ok;
 }
 
 int main(int argc,char **argv){
 
 	if(argc < 2){
-		fprintf(stderr,"Usage: %s <rom_name>\n",argv[0]);
+		fprintf(stderr,"Usage: %s [options] [--record <movie>] <rom_name>\n"
+					   "       %s [options] --replay <movie> [--wav <file>] [--trace <file>] [--profile <file>] <rom_name>\n"
+					   "       %s [options] --headless [--frames N | --insts N] [--wav <file>] [--trace <file>]\n"
+					   "                 [--profile <file>] <rom_name>...\n"
+					   "       %s [options] --batch <manifest> [--copies N] [--threads N] [--scaling]\n"
+					   "       %s [options] --rom-hash <rom_name>...\n"
+					   "       %s [options] --decode-trace <trace>...\n"
+					   "Add --debug to stop in the console debugger before the first instruction, or --gdb <port>\n"
+					   "to wait for gdb on that localhost port (the window and --headless)\n"
+					   "Options: --config <file> --profiles <file> --extension chip8|schip|xochip --ips N\n"
+					   "         --scale N --fg/--bg/--fg2/--blend RRGGBBAA --outlines 0|1 --lerp R\n"
+					   "         --volume N --tone HZ --quirk-vf-reset/-shift/-load-store/-clip/-jump 0|1\n",
+				argv[0],argv[0],argv[0],argv[0],argv[0],argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	config_t config = {0};
-	if(!set_config_from_args(&config,argc,argv)) exit(EXIT_FAILURE);
+	config_t base_config;
+	if(!set_config_from_args(&base_config,argc,argv)) exit(EXIT_FAILURE);
+
+	if(base_config.print_rom_hash) exit(print_rom_hashes(base_config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if(base_config.decode_trace) exit(decode_traces(base_config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if(base_config.batch_file) exit(run_batch(base_config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if(base_config.replay_file) exit(run_replay(base_config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if(base_config.headless) exit(run_headless(base_config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	config_t config;
+	if(!config_for_rom(&base_config,base_config.rom_names[0],&config)) exit(EXIT_FAILURE);
+
+	config.rng_seed = time(NULL);
 
 	sdl_t sdl = {0};
 	if(!init_sdl(&sdl,&config)) exit(EXIT_FAILURE);
 
-	chip8_t chip8 = {0};
-	const char *rom_name = argv[1];
-	if(!init_chip8(&chip8,config,rom_name)) exit(EXIT_FAILURE);
+	//The core runs on its own thread and owns everything in frontend; this thread only pumps events
+	//and presents the frames it publishes, so a slow present never eats into emulation time
+	static frontend_t frontend;
+	chip8_t *chip8 = &frontend.chip8;
+	frontend.config = config;
+	if(!init_chip8(chip8,config,config.rom_names[0])) exit(EXIT_FAILURE);
 
 	clear_screen(config,sdl);
 
-	srand(time(NULL));
-	
-	while(chip8.state != QUIT){
-
-		handle_input(&chip8,&config);
+	if(!init_rewind(&frontend.rewind,&config)) exit(EXIT_FAILURE);
 
-		if(chip8.state == PAUSED) continue;
+	if(config.record_file){
+		frontend.recording = true;
+		frontend.movie = (movie_t){.rng_seed = config.rng_seed, .inst_per_sec = config.inst_per_sec,
+								   .extension = config.current_extension, .quirks = config.quirks,
+								   .rom_hash = hash_rom(chip8)};
+	}
 
-		const uint64_t start_frame_time = SDL_GetPerformanceCounter();
+	init_synth(&frontend.synth, &config, sdl.have.freq);
+	frontend.audio_ring = sdl.audio_ring;
+	if((config.trace_file && !start_trace(chip8)) || (config.profile_file && !start_profile(chip8))) exit(EXIT_FAILURE);
+	frontend.debugger.commands = &frontend.commands;
+	if(config.debug) debugger_break_in(&frontend.debugger, chip8);
+	if(!open_gdb_stub(&frontend.gdb, config.gdb_port, &frontend.debugger)) exit(EXIT_FAILURE);
+	SDL_AtomicSet(&frontend.speed, 8);
+	SDL_AtomicSet(&frontend.frames.middle, 1);
+	frontend.frames.front = 2;
+	frontend.frame_event = SDL_RegisterEvents(1);
+	frontend.wake = SDL_CreateSemaphore(0);
+
+	static screen_t screen;
+	for(size_t i = 0; i < sizeof screen.pixel_color / sizeof screen.pixel_color[0]; i++)
+		screen.pixel_color[i] = config.bg_color;
+	screen.repaint = true;
+
+	SDL_Thread *core = frontend.wake && frontend.frame_event != (Uint32)-1 ?
+					   SDL_CreateThread(emulation_thread, "chip8 core", &frontend) : NULL;
+	if(!core){
+		SDL_Log("Could not start the emulation thread %s\n",SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
 
-		for(uint32_t i=0;i<config.inst_per_sec/60;i++)
-			emulate_instruction(&chip8,config);
+	//With nothing left to fade, sleep until an input or a new frame arrives. A present waits for vsync
+	while(handle_input(&frontend,&screen,!screen.fade_rows && !screen.repaint))
+		present_frame(sdl,config,&frontend,&screen);
 
-		const uint64_t end_frame_time = SDL_GetPerformanceCounter();
+	send_command(&frontend, COMMAND_QUIT);
+	SDL_WaitThread(core, NULL);
+	SDL_DestroySemaphore(frontend.wake);
+	close_gdb_stub(&frontend.gdb);
 
-		const double time_elapsed = (double)((end_frame_time-start_frame_time) * 1000)/SDL_GetPerformanceFrequency();
+	if(screen.latency_count)
+		SDL_Log("Input to photon latency over %u key presses: %.1f ms average, %.1f ms min, %.1f ms max\n",
+				screen.latency_count, screen.latency_total / screen.latency_count,
+				screen.latency_min, screen.latency_max);
 
-		SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
-		if(chip8.draw){
-			update_screen(sdl,config,&chip8);
-			chip8.draw = false;
-		}
-		update_timer(sdl,&chip8);
-	}
+	if(config.record_file)
+		save_movie(&frontend.movie,config.record_file);
 
+	free(frontend.movie.keys);
+	free_rewind(&frontend.rewind);
+	free_chip8(chip8);
 	final_cleanup(sdl);
 
 	exit(EXIT_SUCCESS);